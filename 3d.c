@@ -8,7 +8,18 @@
  * @copyright Copyright (c) 2022
  * 
  */
+// sysconf for System3D_cpu_count
+#define _POSIX_C_SOURCE 200809L
 #include "3d.h"
+#include "3d_platform.c"
+#include "3d_stats.c"
+#include "3d_memory.c"
 #include "3d_representation.c"
 #include "3d_object_factory.c"
+#include "3d_cache.c"
+#include "3d_batch.c"
+#include "3d_mesh.c"
+#include "3d_dedup.c"
+#include "3d_sink.c"
+#include "3d_async_writer.c"
 #include "3d_writer.c"
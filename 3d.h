@@ -10,6 +10,10 @@
 #ifndef THREE_D_H
 #define THREE_D_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #define PI 3.1415926535897932384626433832795028841971
 
 /**
@@ -31,6 +35,37 @@ typedef struct Triangle3D {
   Coordinate3D c;
 } Triangle3D;
 
+/**
+ * Represents a coordinate snapped onto a QuantizationGrid3D.
+ * Each component counts whole grid steps away from the grid's origin, so two
+ * quantized coordinates are the same vertex exactly when their fields match.
+ */
+typedef struct QCoordinate3D {
+  int32_t x;
+  int32_t y;
+  int32_t z;
+} QCoordinate3D;
+
+/**
+ * Represents a triangle whose corners are stored as QCoordinate3Ds.
+ * At 36 bytes it is less than half the size of a Triangle3D.
+ */
+typedef struct QTriangle3D {
+  QCoordinate3D a;
+  QCoordinate3D b;
+  QCoordinate3D c;
+} QTriangle3D;
+
+/**
+ * A uniform fixed-point grid. A quantized coordinate q maps back to
+ * origin + q * scale on every axis, so scale is the grid resolution
+ * (e.g. 0.001 for micron resolution on a millimetre build volume).
+ */
+typedef struct QuantizationGrid3D {
+  Coordinate3D origin;
+  double scale;
+} QuantizationGrid3D;
+
 /** 
  * An Object3D is made up of zero or more triangles,  which can be combined to
  * create a shape such as a cuboid, a circle, a pyramid, etc. This 
@@ -43,6 +78,48 @@ typedef struct Triangle3DNode {
   struct Triangle3DNode * next;
 } Triangle3DNode;
 
+/**
+ * A cap on the bytes the library may allocate for the objects and scenes
+ * charged to it. Every allocation for an object (its nodes, packed arrays
+ * and cached facets) or a scene is charged to the budget that was bound to
+ * the creating thread when the object or scene was created; one that would
+ * go over the limit fails like an out-of-memory malloc, and the call that
+ * needed it returns an error. A budget may be shared by many threads and
+ * must outlive everything charged to it.
+ * Without a bound budget (the default) nothing is capped.
+ */
+typedef struct MemoryBudget3D MemoryBudget3D;
+
+/**
+ * Creates a budget of limit bytes / frees it.
+ *   Return:
+ *     The budget, or NULL if allocation failed
+ */
+MemoryBudget3D* MemoryBudget3D_create(size_t limit);
+void MemoryBudget3D_destroy(MemoryBudget3D* budget);
+
+/**
+ * The bytes currently charged to budget, and its limit.
+ */
+size_t MemoryBudget3D_used(const MemoryBudget3D* budget);
+size_t MemoryBudget3D_limit(const MemoryBudget3D* budget);
+
+/**
+ * Makes budget the one objects and scenes created by the calling thread
+ * are charged to from now on (NULL for none).
+ *   Return:
+ *     The budget that was bound before, to restore it later
+ */
+MemoryBudget3D* MemoryBudget3D_bind(MemoryBudget3D* budget);
+
+/**
+ * A run of already encoded facets, len bytes at data.
+ */
+typedef struct EncodedFacets3D {
+  unsigned char* data;
+  size_t len;
+} EncodedFacets3D;
+
 /** 
  * An Object3D is made up of zero or more triangles, which can be combined to
  * create a single 3D object such as a cube, a circle, a pyramid, etc.
@@ -50,12 +127,104 @@ typedef struct Triangle3DNode {
  * to represent this shape. Then, we have a pointer to the root (the first) 
  * Triangle3DNode, which stores a triangle, and a pointer to the next
  * Triangle3DNode.
+ * tail points at the last node of that list so appending is O(1).
+ * Once an object is quantized, its triangles move into the packed quantized
+ * array (count entries, on the grid stored alongside it) and root is NULL.
+ * Appending triangles to a quantized object (Object3D_append_cuboid,
+ * Object3D_append_quadrilateral, ...) dequantizes it first; it then stays
+ * a linked list until it is quantized again.
+ * In a scene that caches encoded facets (see Scene3D_set_encoding_cache),
+ * stl_text / stl_binary keep this object's facets as last written and dirty
+ * says they are stale. The library sets dirty whenever it changes the
+ * object; code that edits the triangles directly must call
+ * Object3D_mark_dirty.
+ * budget is the MemoryBudget3D the object's memory is charged to, if any.
+ * blocks are node arrays allocated in one piece for objects whose size was
+ * known up front (see Scene3D_append_primitives); nodes inside a block are
+ * freed with it rather than one by one. heap_nodes counts the nodes that
+ * are not in a block.
  */
 typedef struct Object3D {
   long count;
   Triangle3DNode* root;
+  Triangle3DNode* tail;
+  QTriangle3D* quantized;
+  QuantizationGrid3D grid;
+  int dirty;
+  EncodedFacets3D stl_text;
+  EncodedFacets3D stl_binary;
+  MemoryBudget3D* budget;
+  struct Triangle3DBlock* blocks;
+  long heap_nodes;
 } Object3D;
 
+/**
+ * The phases timed by the built-in instrumentation. Nested phases are
+ * inclusive (a fractal's time includes its cuboids' time), and recursive
+ * calls of one phase are only timed at the outermost call. The per-call
+ * phases (quadrilateral, cuboid, pyramid) are sampled: their call counts are
+ * exact, their time is extrapolated from every 16th call.
+ */
+enum Stats3DPhase {
+  STATS3D_QUADRILATERAL,
+  STATS3D_CUBOID,
+  STATS3D_PYRAMID,
+  STATS3D_SPHERE,
+  STATS3D_FRACTAL,
+  STATS3D_WELD,
+  STATS3D_DEDUP,
+  STATS3D_WRITE_STL_TEXT,
+  STATS3D_WRITE_STL_BINARY,
+  STATS3D_WRITE_PLY_BINARY,
+  STATS3D_WRITE_OBJ,
+  STATS3D_PHASE_COUNT
+};
+
+// the entries of a Stats3D's sites: one less allocation sites than this are
+// told apart, the rest share the last entry, "other"
+#define STATS3D_MAX_SITES 48
+
+/**
+ * The allocations made by one function of the library (site is its name).
+ */
+typedef struct Stats3DSite {
+  const char* site;
+  uint64_t allocations;
+  uint64_t bytes;
+} Stats3DSite;
+
+/**
+ * A snapshot of the instrumentation counters, summed over every thread.
+ * triangles_emitted counts triangles created by the factories, allocations
+ * and bytes_allocated the heap allocations made by the library, and
+ * bytes_written the bytes that reached an output file (after compression).
+ * live_bytes and live_allocations are the library's heap memory still
+ * allocated, peak_bytes the most live_bytes reached (see
+ * Stats3D_reset_peak, threads report it in 64 KiB steps so it may come out
+ * that much low per thread); they count the bytes asked for, not malloc's
+ * overhead of a few words per live allocation. sites breaks allocations
+ * and bytes_allocated down by the function that allocated, the most bytes
+ * first. The live, peak and site figures are only kept while memory
+ * tracking is on (see Stats3D_set_memory_tracking) and read 0 otherwise.
+ * objects and triangles describe a scene and are only set by Scene3D_stats.
+ * Everything reads 0 when the library is built with -DSTL3D_NO_STATS.
+ */
+typedef struct Stats3D {
+  uint64_t triangles_emitted;
+  uint64_t allocations;
+  uint64_t bytes_allocated;
+  uint64_t bytes_written;
+  uint64_t live_bytes;
+  uint64_t live_allocations;
+  uint64_t peak_bytes;
+  uint64_t phase_calls[STATS3D_PHASE_COUNT];
+  uint64_t phase_ns[STATS3D_PHASE_COUNT];
+  int site_count;
+  Stats3DSite sites[STATS3D_MAX_SITES];
+  long objects;
+  long triangles;
+} Stats3D;
+
 /**
  * This represents a scene in 3D space containing 0 or more objects within it.
  * The count field represents the number of Object3D's this scene contains.
@@ -63,11 +232,23 @@ typedef struct Object3D {
  * The objects field represents a pointer to an array of Object3D pointers.
  * This array should start off with a small value to save memory, and only grow
  * as needed as more Object3Ds are added.
+ * When quantize is set, every object appended to the scene is stored on the
+ * scene's grid instead of as doubles.
+ * When encoding_cache is set, the STL writers keep each object's encoded
+ * facets for the next export.
+ * budget is the MemoryBudget3D the scene's own memory is charged to (the
+ * objects have their own), owned by the scene if owns_budget is set.
  */
 typedef struct Scene3D {
   long count;
   long size;
   Object3D** objects;
+  int quantize;
+  QuantizationGrid3D grid;
+  int encoding_cache;
+  MemoryBudget3D* budget;
+  int owns_budget;
+  Stats3D stats_baseline;
 } Scene3D;
 
 /**
@@ -77,6 +258,17 @@ typedef struct Scene3D {
  */
 Scene3D* Scene3D_create();
 
+/**
+ * Creates a scene with its own MemoryBudget3D of max_bytes and binds that
+ * budget to the calling thread, so the objects created for it afterwards
+ * count against it. Scene3D_destroy unbinds and frees the budget; objects
+ * charged to it must be appended to the scene or destroyed before that.
+ *   Return:
+ *     The scene, or NULL if it does not fit in max_bytes or allocation
+ *     failed
+ */
+Scene3D* Scene3D_create_bounded(size_t max_bytes);
+
 /** 
  * Frees the memory on the heap for the Scene3D itself, as well as the Object3D
  * and Triangle3DNode's within it.
@@ -92,28 +284,379 @@ void Scene3D_destroy(Scene3D* scene);
  *   Parameters:
  *     scene: The scene to have an object appended to
  *     object: The object to append to this scene
+ *   Return:
+ *     0 on success, -1 if the array could not grow or, in a quantized
+ *     scene, the object's packed array could not be allocated (the object
+ *     is not appended and still belongs to the caller)
+ */
+int Scene3D_append(Scene3D* scene, Object3D* object);
+
+/**
+ * Frees an object that is not part of a scene (e.g. one Scene3D_append
+ * refused), with its triangles. Does nothing for NULL.
+ *   Parameters:
+ *     obj: The object to destroy
+ */
+void Object3D_dtor(Object3D* obj);
+
+/**
+ * Switches the scene to quantized storage on the grid with the given origin
+ * and scale. Objects already in the scene, and every object appended later,
+ * are converted to packed QTriangle3Ds; an object with a coordinate that does
+ * not fit on the int32 grid is left in double storage. The writers
+ * dequantize on the fly.
+ *   Parameters:
+ *     scene: The scene to quantize
+ *     origin: The coordinate that grid point (0,0,0) maps to
+ *     scale: The distance between two adjacent grid points, must be > 0
+ *   Return:
+ *     0 on success, -1 if scale is not a positive finite number or an
+ *     object's packed array could not be allocated (the scene keeps the
+ *     grid; the objects not converted yet stay in double storage)
+ */
+int Scene3D_set_quantization(Scene3D* scene, Coordinate3D origin, double scale);
+
+/**
+ * Converts an object's triangles into packed quantized storage on grid.
+ * If the object is already quantized it is moved onto the new grid.
+ *   Parameters:
+ *     object: The object to convert
+ *     grid: The grid to snap the coordinates onto
+ *   Return:
+ *     object itself, or NULL if a coordinate does not fit on the grid or
+ *     the packed array could not be allocated (the object is left unchanged)
+ */
+Object3D* Object3D_quantize(Object3D* object, QuantizationGrid3D grid);
+
+/**
+ * Converts a quantized object back into the linked list of double
+ * triangles. Does nothing to an object that is not quantized.
+ *   Parameters:
+ *     object: The object to convert
+ *   Return:
+ *     object itself, or NULL if the nodes could not be allocated
+ */
+Object3D* Object3D_dequantize(Object3D* object);
+
+/**
+ * Makes the STL writers keep each object's encoded facets, so that exporting
+ * the scene again only re-encodes the objects that changed since (plus the
+ * new ones) and copies the rest. This trades memory (about the size of the
+ * output file per format) for fast re-exports of an edited scene, e.g.
+ *   Scene3D_set_encoding_cache(scene, 1);
+ *   Scene3D_write_stl_binary(scene, "a.bin.stl");    // encodes everything
+ *   Object3D_translate(scene->objects[3], (Coordinate3D){10, 0, 0});
+ *   Scene3D_write_stl_binary(scene, "a.bin.stl");    // encodes one object
+ * Exporting one scene from several threads at once is not supported while
+ * the cache is on.
+ *   Parameters:
+ *     scene: The scene to configure
+ *     enabled: 1 to cache, 0 to stop caching and free what is cached
+ */
+void Scene3D_set_encoding_cache(Scene3D* scene, int enabled);
+
+/**
+ * Flags an object whose triangles were edited directly, so its cached
+ * facets are encoded again on the next export.
+ */
+void Object3D_mark_dirty(Object3D* object);
+
+/**
+ * Moves every triangle of an object by offset. A quantized object is moved
+ * in doubles and snapped back onto its grid.
+ *   Return:
+ *     object itself, or NULL if a quantized object could not be expanded
+ *     (the object is left unchanged)
  */
-void Scene3D_append(Scene3D* scene, Object3D* object);
+Object3D* Object3D_translate(Object3D* object, Coordinate3D offset);
+
+/**
+ * Exact vertex equality for quantized coordinates.
+ *   Return:
+ *     1 if a and b are the same grid point, 0 otherwise
+ */
+int QCoordinate3D_equal(QCoordinate3D a, QCoordinate3D b);
+
+/**
+ * Removes every triangle that repeats an earlier one of the scene (earlier
+ * in object order, then in each object's triangle order), so only the first
+ * of each set of duplicates is written. Two triangles are duplicates when
+ * their corners, each snapped to the nearest multiple of tolerance, are the
+ * same set of points in any order; a coincident face of the opposite
+ * winding counts as well. Objects left without triangles stay in the scene.
+ * Run it before the writers, e.g. after merging overlapping objects.
+ *   Parameters:
+ *     scene: The scene to clean up
+ *     tolerance: The grid step corners are snapped to, 0 for exact matches
+ *     threads: Threads to spread the pass over, <= 0 for one per CPU
+ *   Return:
+ *     The number of triangles removed, or -1 if tolerance is negative or
+ *     the working memory (including the compacted triangle arrays of
+ *     quantized objects) could not be allocated (the scene is unchanged)
+ */
+long Scene3D_dedup_triangles(Scene3D* scene, double tolerance, int threads);
+
+/**
+ * Fills out with the process-wide instrumentation counters accumulated
+ * since the scene was created, plus the scene's object and triangle count.
+ * Work done for other scenes concurrently is included as well, and the
+ * live and peak bytes are those of the whole process.
+ *   Parameters:
+ *     scene: The scene to query
+ *     out: Where to store the statistics
+ */
+void Scene3D_stats(Scene3D* scene, Stats3D* out);
+
+/**
+ * Fills out with the instrumentation counters of the whole process.
+ * Setting the environment variable STL3D_STATS to 1 (or to a file name)
+ * turns memory tracking on and dumps this snapshot to stderr (or that
+ * file) when the process exits, as JSON if the value is json or the file
+ * name ends in .json.
+ */
+void Stats3D_snapshot(Stats3D* out);
+
+/**
+ * Turns the live, peak and per-site memory figures of Stats3D on or off
+ * (off by default, as they cost a little on every allocation and free).
+ * Turn them on before the library allocates what should be counted: memory
+ * allocated while tracking was off is not live to the statistics, and
+ * freeing it with tracking on makes live_bytes read low.
+ *   Parameters:
+ *     enabled: Nonzero to track, 0 to stop
+ */
+void Stats3D_set_memory_tracking(int enabled);
+
+/**
+ * Restarts peak_bytes from the bytes live now, e.g. to measure the peak of
+ * one job or benchmark at a time.
+ */
+void Stats3D_reset_peak();
+
+/**
+ * The library's live heap bytes per triangle: live_bytes divided by the
+ * scene's triangles for a Scene3D_stats snapshot, by triangles_emitted
+ * otherwise.
+ *   Return:
+ *     The bytes per triangle, or 0 if there are no triangles
+ */
+double Stats3D_bytes_per_triangle(const Stats3D* stats);
+
+/**
+ * Prints stats in a human readable form to f.
+ */
+void Stats3D_dump(const Stats3D* stats, FILE* f);
+
+/**
+ * Prints stats to f as one JSON object, with the same fields as Stats3D
+ * (phases and sites as objects keyed by name) plus bytes_per_triangle.
+ */
+void Stats3D_dump_json(const Stats3D* stats, FILE* f);
+
+/**
+ * The number of CPUs online, used as the default thread count for the
+ * parallel parts of the library.
+ */
+int System3D_cpu_count();
 
 /**
  * Write every shape from the Scene3D to the file with file_name using the STL
  * text format. The function is responsible for opening, writing to, and 
- * closing the file.
+ * closing the file. Facets are formatted on the calling thread while an
+ * AsyncWriter3D thread writes the previous buffers to disk.
  *   Parameters:
  *     scene: The scene to write to the file
  *     file_name: The name of the file to write the STL data to
+ *   Return:
+ *     0 on success, -1 if the file could not be opened or written
  */
-void Scene3D_write_stl_text(Scene3D* scene, char* file_name);
+int Scene3D_write_stl_text(Scene3D* scene, char* file_name);
 
 /**
  * Write every shape from the Scene3D to the file with file_name using the STL
  * binary format. The function is responsible for opening, writing to, and 
- * closing the file.
+ * closing the file. Facets are packed on the calling thread while an
+ * AsyncWriter3D thread writes the previous buffers to disk.
  *   Parameters:
  *     scene: The scene to write to the file
  *     file_name: The name of the file to write the STL data to
+ *   Return:
+ *     0 on success, -1 if the file could not be opened or written, or the
+ *     scene has more than UINT32_MAX triangles (the most binary STL counts)
+ */
+int Scene3D_write_stl_binary(Scene3D* scene, char* file_name);
+
+/**
+ * Write the Scene3D to file_name as a binary little-endian PLY file.
+ * The scene is first welded into an IndexedMesh3D, so every distinct vertex
+ * is stored once (12 bytes) and each face is 13 bytes, against 50 bytes per
+ * facet for binary STL.
+ *   Parameters:
+ *     scene: The scene to write to the file
+ *     file_name: The name of the file to write the PLY data to
+ *   Return:
+ *     0 on success, -1 if welding failed or the file could not be written
  */
-void Scene3D_write_stl_binary(Scene3D* scene, char* file_name);
+int Scene3D_write_ply_binary(Scene3D* scene, char* file_name);
+
+/**
+ * Write the Scene3D to file_name as a Wavefront OBJ file, welded the same
+ * way as Scene3D_write_ply_binary.
+ *   Parameters:
+ *     scene: The scene to write to the file
+ *     file_name: The name of the file to write the OBJ data to
+ *   Return:
+ *     0 on success, -1 if welding failed or the file could not be written
+ */
+int Scene3D_write_obj(Scene3D* scene, char* file_name);
+
+/**
+ * A welded, indexed form of a scene's triangles.
+ * vertices holds vertex_count distinct (x,y,z) float triples; two corners
+ * are welded when their float values are identical. indices holds 3
+ * vertex indices for each of the face_count faces, in the scene's triangle
+ * order. It is charged to the budget of the scene it was welded from.
+ */
+typedef struct IndexedMesh3D {
+  long vertex_count;
+  long vertex_capacity;
+  float* vertices;
+  long face_count;
+  uint32_t* indices;
+  MemoryBudget3D* budget;
+} IndexedMesh3D;
+
+/**
+ * Welds every triangle of the scene into a new IndexedMesh3D on the heap.
+ * Weld once and call the IndexedMesh3D writers to produce several formats
+ * (or to compare vertex_count/face_count before picking one).
+ *   Return:
+ *     The mesh, or NULL if allocation failed or the scene has too many
+ *     triangles for 32-bit indices
+ */
+IndexedMesh3D* IndexedMesh3D_from_scene(Scene3D* scene);
+void IndexedMesh3D_destroy(IndexedMesh3D* mesh);
+int IndexedMesh3D_write_ply_binary(const IndexedMesh3D* mesh, char* file_name);
+int IndexedMesh3D_write_obj(const IndexedMesh3D* mesh, char* file_name);
+
+/**
+ * A destination for the bytes produced by the writers. Every writer has a
+ * Scene3D_swrite_* / IndexedMesh3D_swrite_* variant that streams into a sink
+ * instead of a named file, e.g. to compress while writing:
+ *   Scene3D_swrite_stl_text(scene, OutputSink3D_open_gzip("a.stl.gz", 6, 0));
+ * The functions in the struct return 0 on success and -1 on failure; close
+ * also frees the sink. A sink's buffers, and the writers' own buffers, are
+ * charged to the MemoryBudget3D bound to the thread that opened them.
+ */
+typedef struct OutputSink3D OutputSink3D;
+struct OutputSink3D {
+  int (*write)(OutputSink3D* sink, const void* data, size_t len);
+  int (*flush)(OutputSink3D* sink);
+  int (*close)(OutputSink3D* sink);
+};
+
+/**
+ * Opens file_name with the given fopen mode as a sink.
+ *   Return:
+ *     The sink, or NULL if the file could not be opened
+ */
+OutputSink3D* OutputSink3D_open_file(const char* file_name, const char* mode);
+
+/**
+ * Wraps an already open FILE as a sink. Closing the sink only flushes f;
+ * the caller stays responsible for closing it.
+ */
+OutputSink3D* OutputSink3D_from_file(FILE* f);
+
+/**
+ * Opens file_name as a sink that writes a single gzip stream. The input is
+ * cut into 128 KiB blocks that are deflated independently (like pigz) by a
+ * pool of worker threads and written out in order, so a large scene lands
+ * on disk compressed in one pass.
+ *   Parameters:
+ *     file_name: The name of the .gz file to create
+ *     level: zlib compression level, 1 (fastest) to 9 (smallest)
+ *     threads: The number of compression threads, or <= 0 for one per CPU
+ *              (callers writing several files at once should share the
+ *              CPUs out instead); each holds two blocks of about 256 KiB
+ *   Return:
+ *     The sink, or NULL if the file could not be opened or the compressor
+ *     could not be set up (or its blocks did not fit in the budget)
+ */
+OutputSink3D* OutputSink3D_open_gzip(const char* file_name, int level, int threads);
+
+/**
+ * The sink variants of the writers above. Each takes ownership of sink and
+ * closes it before returning, even on failure; a NULL sink (e.g. a failed
+ * OutputSink3D_open_*) is reported as a failure.
+ *   Return:
+ *     0 on success, -1 if anything failed, including closing the sink
+ */
+int Scene3D_swrite_stl_text(Scene3D* scene, OutputSink3D* sink);
+int Scene3D_swrite_stl_binary(Scene3D* scene, OutputSink3D* sink);
+int Scene3D_swrite_ply_binary(Scene3D* scene, OutputSink3D* sink);
+int Scene3D_swrite_obj(Scene3D* scene, OutputSink3D* sink);
+int IndexedMesh3D_swrite_ply_binary(const IndexedMesh3D* mesh, OutputSink3D* sink);
+int IndexedMesh3D_swrite_obj(const IndexedMesh3D* mesh, OutputSink3D* sink);
+
+/**
+ * An output stage that owns a file and a writer thread. Bytes handed to it
+ * are collected into one of a small ring of large swap buffers; whenever a
+ * buffer fills up it is queued for the writer thread, and the caller only
+ * blocks when every buffer is still waiting on the disk.
+ * An AsyncWriter3D must only be fed from one thread.
+ */
+typedef struct AsyncWriter3D AsyncWriter3D;
+
+/**
+ * Opens file_name with the given fopen mode and starts the writer thread.
+ *   Return:
+ *     The new writer, or NULL if the file could not be opened or the
+ *     buffers/thread could not be created
+ */
+AsyncWriter3D* AsyncWriter3D_open(const char* file_name, const char* mode);
+
+/**
+ * Starts a writer thread that drains into sink. The writer takes ownership
+ * of sink and closes it in AsyncWriter3D_close (or right away on failure).
+ *   Return:
+ *     The new writer, or NULL if sink is NULL or the buffers/thread could
+ *     not be created
+ */
+AsyncWriter3D* AsyncWriter3D_open_sink(OutputSink3D* sink);
+
+/**
+ * Queues len bytes from data for writing.
+ *   Return:
+ *     0 on success, -1 if an earlier write to the file failed
+ */
+int AsyncWriter3D_write(AsyncWriter3D* writer, const void* data, size_t len);
+
+/**
+ * Returns a pointer to at least len contiguous free bytes in the current
+ * buffer so the caller can format directly into it, then publishes the
+ * bytes actually used with AsyncWriter3D_commit.
+ *   Return:
+ *     The space to format into, or NULL if len is larger than a buffer or
+ *     an earlier write to the file failed
+ */
+unsigned char* AsyncWriter3D_reserve(AsyncWriter3D* writer, size_t len);
+void AsyncWriter3D_commit(AsyncWriter3D* writer, size_t len);
+
+/**
+ * Blocks until every byte handed over so far is written and the sink is
+ * flushed.
+ *   Return:
+ *     0 on success, -1 if any write or the flush failed
+ */
+int AsyncWriter3D_flush(AsyncWriter3D* writer);
+
+/**
+ * Flushes, stops the writer thread, closes the sink and frees the writer.
+ *   Return:
+ *     0 if every write, the flush and the close succeeded, -1 otherwise
+ */
+int AsyncWriter3D_close(AsyncWriter3D* writer);
 
 /**
  * This function should create a new Object3D on the heap and populate it with
@@ -125,12 +668,35 @@ void Scene3D_write_stl_binary(Scene3D* scene, char* file_name);
  *     radius: The desired radius of the sphere
  *     increment: A value in the range (180, 0) that determines 
  *                the smoothness of the sphere.
- *                
+ *   Return:
+ *     The new object, or NULL if allocation failed or the memory budget
+ *     ran out
  */
 Object3D* Object3D_create_sphere(
     Coordinate3D origin,
     double radius, double increment);
 
+/**
+ * Creates a sphere that is accurate to tolerance instead of a fixed angle:
+ * no point of its surface is farther than about tolerance from the true
+ * sphere. Latitude rings are spaced by that bound and each ring gets as
+ * few segments as it needs, so rings near the poles get fewer; neighbouring
+ * rings are stitched without T-junctions and the poles are closed by fans.
+ * For the same accuracy this takes far fewer triangles than
+ * Object3D_create_sphere, whose rows all have as many quads as the equator.
+ *   Parameters:
+ *     origin: The origin point for the sphere (center)
+ *     radius: The desired radius of the sphere
+ *     tolerance: The largest allowed distance from the true surface, > 0
+ *   Return:
+ *     The new object, or NULL if radius or tolerance are not positive (or
+ *     tolerance is too small to resolve), allocation failed or the memory
+ *     budget ran out
+ */
+Object3D* Object3D_create_sphere_lod(
+    Coordinate3D origin,
+    double radius, double tolerance);
+
 /**
  * This function should create a new Object3D on the heap and populate it with
  * a bunch of triangles to represent a pyramid in 3D space.
@@ -148,6 +714,9 @@ Object3D* Object3D_create_sphere(
  *                    "down"
  *                    "left"
  *                    "right"
+ *   Return:
+ *     The new object, or NULL if orientation is not one of those,
+ *     allocation failed or the memory budget ran out
  */
 Object3D* Object3D_create_pyramid(
     Coordinate3D origin, 
@@ -163,11 +732,30 @@ Object3D* Object3D_create_pyramid(
  *     width: The width of the cuboid (x)
  *     height: The height of the cuboid (y)
  *     depth: The depth of the cuboid (z)
+ *   Return:
+ *     The new object, or NULL if allocation failed or the memory budget
+ *     ran out
  */
 Object3D* Object3D_create_cuboid(
     Coordinate3D origin, 
     double width, double height, double depth);
 
+/**
+ * Same as Object3D_create_cuboid, but appends the cuboid's triangles to an
+ * existing object instead of creating one, so composite shapes (the
+ * fractal) are built in place. A quantized object is dequantized first (see
+ * Object3D_dequantize).
+ *   Parameters:
+ *     object: The Object3D to append to
+ *     origin/width/height/depth: As for Object3D_create_cuboid
+ *   Return:
+ *     0 on success, -1 if the object could not be dequantized or a triangle
+ *     could not be allocated (the object may hold part of the cuboid)
+ */
+int Object3D_append_cuboid(
+    Object3D* object, Coordinate3D origin,
+    double width, double height, double depth);
+
 /**
  * This function should create a new Object3D on the heap and populate it with
  * a bunch of triangles to represent a cube-based fractal in 3D space.
@@ -177,22 +765,190 @@ Object3D* Object3D_create_cuboid(
  *     origin: The origin point for the fractal (center)
  *     size: Used for the width, height, and depth of the center cube
  *     levels: The number of levels to recurse to when building the fractal
+ *   Return:
+ *     The new object, or NULL if allocation failed or the memory budget
+ *     ran out
  */
 Object3D* Object3D_create_fractal(
-    Coordinate3D origin, 
+    Coordinate3D origin,
     double size, int levels);
 
+/**
+ * The directions a pyramid can point to, in the same order as the
+ * orientation strings of Object3D_create_pyramid are matched.
+ */
+typedef enum Orientation3D {
+  ORIENTATION3D_RIGHT,
+  ORIENTATION3D_UP,
+  ORIENTATION3D_BACKWARD,
+  ORIENTATION3D_LEFT,
+  ORIENTATION3D_DOWN,
+  ORIENTATION3D_FORWARD,
+  ORIENTATION3D_COUNT
+} Orientation3D;
+
+/**
+ * Looks up the Orientation3D of an orientation string ("up", "left", ...).
+ *   Return:
+ *     0 with *out set, or -1 if name is not an orientation
+ */
+int Orientation3D_parse(const char* name, Orientation3D* out);
+
+/**
+ * Same as Object3D_create_pyramid, without the string lookup.
+ *   Return:
+ *     The new object, or NULL if orientation is out of range, allocation
+ *     failed or the memory budget ran out
+ */
+Object3D* Object3D_create_pyramid_oriented(
+    Coordinate3D origin,
+    double width, double height, Orientation3D orientation);
+
+// fractals deeper than this have more triangles than a long can count
+#define PRIMITIVE3D_MAX_LEVELS 20
+// spheres finer than this (in degrees) have over 10^13 triangles, and
+// increments that vanish next to 180 would never finish the rows
+#define PRIMITIVE3D_MIN_INCREMENT 1e-4
+
+typedef enum Primitive3DKind {
+  PRIMITIVE3D_CUBOID,
+  PRIMITIVE3D_PYRAMID,
+  PRIMITIVE3D_SPHERE,
+  PRIMITIVE3D_FRACTAL,
+  PRIMITIVE3D_SPHERE_LOD
+} Primitive3DKind;
+
+/**
+ * A description of one primitive to build: kind says which member of the
+ * union holds its parameters (those of the matching Object3D_create_*).
+ */
+typedef struct Primitive3D {
+  Primitive3DKind kind;
+  Coordinate3D origin;
+  union {
+    struct { double width, height, depth; } cuboid;
+    struct { double width, height; Orientation3D orientation; } pyramid;
+    struct { double radius, increment; } sphere;
+    struct { double size; int levels; } fractal;
+    struct { double radius, tolerance; } sphere_lod;
+  };
+} Primitive3D;
+
+/**
+ * The number of triangles a primitive is built with (at most, for spheres).
+ *   Return:
+ *     The count, or -1 if the parameters are invalid (a sphere increment
+ *     outside [PRIMITIVE3D_MIN_INCREMENT, 180), fractal levels outside
+ *     [0, PRIMITIVE3D_MAX_LEVELS], a sphere radius or fractal size that is
+ *     not finite, a level-of-detail sphere Object3D_create_sphere_lod
+ *     refuses)
+ */
+long Primitive3D_triangles(const Primitive3D* primitive);
+
+/**
+ * Builds a primitive with the matching Object3D_create_* factory.
+ *   Return:
+ *     The new object, or NULL if the parameters are invalid, allocation
+ *     failed or the memory budget ran out
+ */
+Object3D* Primitive3D_create(const Primitive3D* primitive);
+
+/**
+ * Builds count primitives and appends them to scene in array order, the
+ * same objects one Primitive3D_create + Scene3D_append per primitive would
+ * give. The sizes are computed first: the scene's array grows once, and
+ * each object's nodes are allocated as a single block. The primitives are
+ * built on up to threads threads (<= 0 for one per CPU), each charged to
+ * the budget bound to the calling thread.
+ *   Parameters:
+ *     scene: The scene to append to
+ *     primitives: The primitives to build
+ *     count: The number of primitives
+ *     threads: The number of threads to build on
+ *   Return:
+ *     0 on success, -1 if a primitive is invalid or did not fit in memory
+ *     (nothing is appended then)
+ */
+int Scene3D_append_primitives(Scene3D* scene, const Primitive3D* primitives,
+    long count, int threads);
+
+/**
+ * A memo of generated spheres and fractals, keyed by their shape parameters
+ * without the origin. Each entry is a canonical mesh built at (0,0,0) and
+ * packed into a Triangle3D array; later requests get a copy translated to
+ * their origin instead of regenerating it. The total size of the entries
+ * never exceeds the cache's max_bytes and the least recently used ones are
+ * evicted first. Entries being copied from cannot be evicted; a new shape
+ * that only fits by evicting one of those is built and returned, but not
+ * cached.
+ * A cache may be shared by any number of threads.
+ * Note: a translated copy is the same shape, but not always the same bytes
+ * as a directly built one. The fractal factory offsets its origin step by
+ * step, so coordinates can differ in their last bits, and the quadrilaterals
+ * of a sphere have diagonals of (nearly) equal length, so rounding at a
+ * different origin often picks the other diagonal to split them along.
+ */
+typedef struct PrimitiveCache3D PrimitiveCache3D;
+
+typedef struct PrimitiveCache3DStats {
+  long entries;
+  size_t bytes;
+  long hits;
+  long misses;
+  long evictions;
+} PrimitiveCache3DStats;
+
+/**
+ * Creates an empty cache whose entries may take up to max_bytes.
+ *   Return:
+ *     The cache, or NULL if allocation failed
+ */
+PrimitiveCache3D* PrimitiveCache3D_create(size_t max_bytes);
+void PrimitiveCache3D_destroy(PrimitiveCache3D* cache);
+
+/**
+ * Same as Object3D_create_sphere / Object3D_create_fractal, but served from
+ * cache when it already holds the shape. A NULL cache, or a shape larger
+ * than the whole cache, falls back to the factory.
+ *   Return:
+ *     A new Object3D owned by the caller, or NULL if allocation failed or
+ *     the parameters are invalid (see Primitive3D_triangles)
+ */
+Object3D* PrimitiveCache3D_create_sphere(PrimitiveCache3D* cache,
+    Coordinate3D origin, double radius, double increment);
+Object3D* PrimitiveCache3D_create_fractal(PrimitiveCache3D* cache,
+    Coordinate3D origin, double size, int levels);
+
+/**
+ * Persists every entry of cache to file_name / adds the entries stored in
+ * file_name to cache (evicting as needed), so a later run can start warm.
+ * The file stores little-endian IEEE doubles and is portable.
+ *   Return:
+ *     0 on success, -1 if the file could not be written, or could not be
+ *     read or is not a cache file, including an entry whose parameters are
+ *     invalid or whose triangle count they cannot produce (entries read
+ *     before the error are kept)
+ */
+int PrimitiveCache3D_save(PrimitiveCache3D* cache, const char* file_name);
+int PrimitiveCache3D_load(PrimitiveCache3D* cache, const char* file_name);
+
+void PrimitiveCache3D_stats(PrimitiveCache3D* cache, PrimitiveCache3DStats* out);
+
 /**
  * Add a quadrilateral to an object in a deterministic way.
  * Use this method any time you need a square, rectangular, or quadrilateral
  * Shape for any of the objects.
  * Thus, this should be called from Object3D_create_cuboid, 
  * Object3D_create_pyramid, and Object3D_create_sphere.
+ * A quantized object is dequantized first (see Object3D_dequantize).
  *   Parameters: 
  *     object: The Object3D to append to
  *     a/b/c/d: The coordinates to use for the corners of the quadrilateral.
+ *   Return:
+ *     0 on success, -1 if the object could not be dequantized or a triangle
+ *     could not be allocated (the object may hold part of the quadrilateral)
  */
-void Object3D_append_quadrilateral(
+int Object3D_append_quadrilateral(
     Object3D* object, 
     Coordinate3D a, Coordinate3D b, 
     Coordinate3D c, Coordinate3D d);
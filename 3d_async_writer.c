@@ -0,0 +1,214 @@
+/**
+ * @file 3d_async_writer.c
+ * @author Pegasust
+ * @brief A double-buffered output stage: the caller formats bytes into swap
+ * buffers while a dedicated writer thread drains filled ones into a sink
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "3d.h"
+
+#define ASYNC_WRITER_BUFFER_SIZE (1 << 20)
+#define ASYNC_WRITER_BUFFER_COUNT 4
+
+/**
+ * The buffers form a ring. The producer owns buffers[current]; the writer
+ * thread owns the `queued` buffers starting from buffers[next_write] until it
+ * has written them out. Everything but the sink and the producer's buffer is
+ * guarded by lock.
+ */
+struct AsyncWriter3D {
+    OutputSink3D* sink;
+    MemoryBudget3D* budget;
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t filled;
+    cnd_t drained;
+    unsigned char* buffers[ASYNC_WRITER_BUFFER_COUNT];
+    size_t lengths[ASYNC_WRITER_BUFFER_COUNT];
+    int current;
+    int next_write;
+    int queued;
+    int closing;
+    int error;
+};
+
+int AsyncWriter3D_thread(void* arg) {
+    AsyncWriter3D* w = arg;
+    mtx_lock(&w->lock);
+    for(;;) {
+        while(w->queued == 0 && !w->closing) {
+            cnd_wait(&w->filled, &w->lock);
+        }
+        if(w->queued == 0) {
+            break; // closing and nothing left
+        }
+        int i = w->next_write;
+        int failed = w->error;
+        mtx_unlock(&w->lock);
+        // the disk write happens outside of the lock so the producer can
+        // keep formatting into its own buffer meanwhile.
+        // once an error is recorded, the remaining buffers are discarded
+        if(!failed && w->sink->write(w->sink, w->buffers[i], w->lengths[i]) != 0) {
+            failed = 1;
+        }
+        mtx_lock(&w->lock);
+        w->error |= failed;
+        w->next_write = (w->next_write + 1) % ASYNC_WRITER_BUFFER_COUNT;
+        --w->queued;
+        cnd_signal(&w->drained);
+    }
+    mtx_unlock(&w->lock);
+    return 0;
+}
+
+AsyncWriter3D* AsyncWriter3D_open_sink(OutputSink3D* sink) {
+    if(sink == NULL) {
+        return NULL;
+    }
+    MemoryBudget3D* budget = MemoryBudget3D_bound();
+    AsyncWriter3D* w = mem3d_calloc(budget, 1, sizeof(AsyncWriter3D));
+    if(w == NULL) {
+        sink->close(sink);
+        return NULL;
+    }
+    w->budget = budget;
+    int i = 0;
+    for(; i < ASYNC_WRITER_BUFFER_COUNT; ++i) {
+        w->buffers[i] = mem3d_malloc(w->budget, ASYNC_WRITER_BUFFER_SIZE);
+        if(w->buffers[i] == NULL) {
+            goto fail_buffers;
+        }
+    }
+    if(mtx_init(&w->lock, mtx_plain) != thrd_success) {
+        goto fail_buffers;
+    }
+    if(cnd_init(&w->filled) != thrd_success) {
+        goto fail_lock;
+    }
+    if(cnd_init(&w->drained) != thrd_success) {
+        goto fail_filled;
+    }
+    w->sink = sink;
+    if(thrd_create(&w->thread, AsyncWriter3D_thread, w) != thrd_success) {
+        goto fail_drained;
+    }
+    return w;
+
+fail_drained:
+    cnd_destroy(&w->drained);
+fail_filled:
+    cnd_destroy(&w->filled);
+fail_lock:
+    mtx_destroy(&w->lock);
+fail_buffers:
+    while(--i >= 0) {
+        mem3d_free(w->budget, w->buffers[i], ASYNC_WRITER_BUFFER_SIZE);
+    }
+    mem3d_free(w->budget, w, sizeof(AsyncWriter3D));
+    sink->close(sink);
+    return NULL;
+}
+
+AsyncWriter3D* AsyncWriter3D_open(const char* file_name, const char* mode) {
+    return AsyncWriter3D_open_sink(OutputSink3D_open_file(file_name, mode));
+}
+
+/**
+ * @brief Hands the producer's buffer to the writer thread (if it holds any
+ * bytes) and waits for the next buffer in the ring to be free.
+ *
+ * @param w
+ * @return int 0 on success, -1 if the writer thread hit an I/O error
+ */
+int AsyncWriter3D_swap(AsyncWriter3D* w) {
+    mtx_lock(&w->lock);
+    if(w->lengths[w->current] > 0) {
+        ++w->queued;
+        cnd_signal(&w->filled);
+        w->current = (w->current + 1) % ASYNC_WRITER_BUFFER_COUNT;
+        while(w->queued == ASYNC_WRITER_BUFFER_COUNT) {
+            cnd_wait(&w->drained, &w->lock);
+        }
+        w->lengths[w->current] = 0;
+    }
+    int error = w->error;
+    mtx_unlock(&w->lock);
+    return error? -1: 0;
+}
+
+unsigned char* AsyncWriter3D_reserve(AsyncWriter3D* w, size_t len) {
+    if(len > ASYNC_WRITER_BUFFER_SIZE) {
+        return NULL;
+    }
+    if(ASYNC_WRITER_BUFFER_SIZE - w->lengths[w->current] < len
+    && AsyncWriter3D_swap(w) != 0) {
+        return NULL;
+    }
+    return w->buffers[w->current] + w->lengths[w->current];
+}
+
+void AsyncWriter3D_commit(AsyncWriter3D* w, size_t len) {
+    w->lengths[w->current] += len;
+}
+
+int AsyncWriter3D_write(AsyncWriter3D* w, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    while(len > 0) {
+        size_t room = ASYNC_WRITER_BUFFER_SIZE - w->lengths[w->current];
+        if(room == 0) {
+            if(AsyncWriter3D_swap(w) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t n = len < room? len: room;
+        memcpy(w->buffers[w->current] + w->lengths[w->current], bytes, n);
+        w->lengths[w->current] += n;
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int AsyncWriter3D_flush(AsyncWriter3D* w) {
+    if(AsyncWriter3D_swap(w) != 0) {
+        return -1;
+    }
+    mtx_lock(&w->lock);
+    while(w->queued > 0) {
+        cnd_wait(&w->drained, &w->lock);
+    }
+    int error = w->error;
+    mtx_unlock(&w->lock);
+    // the writer thread is idle now, so the sink is ours to flush
+    if(!error && w->sink->flush(w->sink) != 0) {
+        error = 1;
+    }
+    return error? -1: 0;
+}
+
+int AsyncWriter3D_close(AsyncWriter3D* w) {
+    int status = AsyncWriter3D_flush(w);
+    mtx_lock(&w->lock);
+    w->closing = 1;
+    cnd_signal(&w->filled);
+    mtx_unlock(&w->lock);
+    thrd_join(w->thread, NULL);
+    if(w->sink->close(w->sink) != 0) {
+        status = -1;
+    }
+    cnd_destroy(&w->drained);
+    cnd_destroy(&w->filled);
+    mtx_destroy(&w->lock);
+    for(int i = 0; i < ASYNC_WRITER_BUFFER_COUNT; ++i) {
+        mem3d_free(w->budget, w->buffers[i], ASYNC_WRITER_BUFFER_SIZE);
+    }
+    mem3d_free(w->budget, w, sizeof(AsyncWriter3D));
+    return status;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file 3d_batch.c
+ * @author Pegasust
+ * @brief A source file for building a whole array of primitive descriptors
+ * into a Scene3D in one call, sized up front and spread over threads
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdlib.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "3d.h"
+
+/**
+ * The state shared by the threads building one batch. Primitives are handed
+ * out through next; objects[i] receives the object built from primitives[i].
+ */
+typedef struct PrimitiveBatch {
+    const Primitive3D* primitives;
+    long count;
+    Object3D** objects;
+    MemoryBudget3D* budget;
+    _Atomic long next;
+    atomic_int failed;
+} PrimitiveBatch;
+
+int Primitive3D_append(Object3D* object, const Primitive3D* primitive);
+
+/**
+ * @brief Builds a primitive into an object that owns one block of nodes
+ * sized for it, so its triangles are not allocated one by one.
+ *
+ * @return Object3D* the object, or NULL if it could not be built
+ */
+Object3D* Primitive3D_create_in_block(const Primitive3D* primitive, MemoryBudget3D* budget) {
+    long triangles = Primitive3D_triangles(primitive);
+    if(triangles <= 0) {
+        return triangles == 0? Primitive3D_create(primitive): NULL;
+    }
+    Object3D* object = Object3D_empty_ctor();
+    if(object == NULL) {
+        return NULL;
+    }
+    object->blocks = Triangle3DBlock_create(budget, triangles);
+    if(object->blocks == NULL || Primitive3D_append(object, primitive) != 0) {
+        Object3D_dtor(object);
+        return NULL;
+    }
+    return object;
+}
+
+int PrimitiveBatch_worker(void* arg) {
+    PrimitiveBatch* batch = arg;
+    MemoryBudget3D* previous = MemoryBudget3D_bind(batch->budget);
+    for(long i; !atomic_load(&batch->failed)
+        && (i = atomic_fetch_add(&batch->next, 1)) < batch->count;)
+    {
+        batch->objects[i] = Primitive3D_create_in_block(&batch->primitives[i], batch->budget);
+        if(batch->objects[i] == NULL) {
+            atomic_store(&batch->failed, 1);
+        }
+    }
+    MemoryBudget3D_bind(previous);
+    return 0;
+}
+
+int Scene3D_append_primitives(Scene3D* scene, const Primitive3D* primitives,
+    long count, int threads)
+{
+    if(count <= 0) {
+        return count == 0? 0: -1;
+    }
+    for(long i = 0; i < count; ++i) {
+        if(Primitive3D_triangles(&primitives[i]) < 0) {
+            return -1;
+        }
+    }
+    if(Scene3D_reserve(scene, count) != 0) {
+        return -1;
+    }
+    PrimitiveBatch batch;
+    batch.primitives = primitives;
+    batch.count = count;
+    batch.budget = MemoryBudget3D_bound();
+    batch.objects = mem3d_calloc(scene->budget, count, sizeof(Object3D*));
+    if(batch.objects == NULL) {
+        return -1;
+    }
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, 0);
+    if(threads <= 0) {
+        threads = System3D_cpu_count();
+    }
+    threads = threads < count? threads: (int)count;
+    System3D_run_threads(threads, PrimitiveBatch_worker, &batch);
+
+    int status = atomic_load(&batch.failed)? -1: 0;
+    long appended = scene->count;
+    for(long i = 0; i < count && status == 0; ++i) {
+        // the array was reserved, only quantizing can fail
+        status = Scene3D_append(scene, batch.objects[i]);
+    }
+    if(status != 0) {
+        // take back what was appended so the scene is unchanged
+        scene->count = appended;
+        for(long i = 0; i < count; ++i) {
+            Object3D_dtor(batch.objects[i]);
+        }
+    }
+    mem3d_free(scene->budget, batch.objects, count * sizeof(Object3D*));
+    return status;
+}
@@ -0,0 +1,435 @@
+/**
+ * @file 3d_cache.c
+ * @author Pegasust
+ * @brief A source file for the primitive cache: canonical spheres and
+ * fractals memoized by shape, served by translation and evicted LRU
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "3d.h"
+
+#define PRIMITIVE_CACHE_MAGIC "STL3DPC1"
+// kind, levels, 2 parameters, triangle count
+#define PRIMITIVE_CACHE_ENTRY_HEADER_LEN (4 + 4 + 8 + 8 + 8)
+#define PRIMITIVE_CACHE_TRIANGLE_LEN (9 * 8)
+
+enum PrimitiveCacheKind {
+    PRIMITIVE_CACHE_SPHERE,
+    PRIMITIVE_CACHE_FRACTAL
+};
+
+/**
+ * What a cached shape depends on: sphere (radius, increment) or fractal
+ * (size, levels). Two keys match when every field is equal.
+ */
+typedef struct PrimitiveKey {
+    uint32_t kind;
+    int32_t levels;
+    double a;
+    double b;
+} PrimitiveKey;
+
+/**
+ * One canonical mesh. refs counts the requests copying out of triangles
+ * right now; such an entry is never freed until they are done.
+ */
+typedef struct PrimitiveEntry {
+    PrimitiveKey key;
+    long count;
+    Triangle3D* triangles;
+    int refs;
+    struct PrimitiveEntry* prev;
+    struct PrimitiveEntry* next;
+} PrimitiveEntry;
+
+/**
+ * Entries form a list from the most (head) to the least (tail) recently
+ * used. There are few enough distinct shapes in a batch that a linear
+ * lookup beats hashing. Everything is guarded by lock.
+ */
+struct PrimitiveCache3D {
+    mtx_t lock;
+    size_t max_bytes;
+    PrimitiveEntry* head;
+    PrimitiveEntry* tail;
+    PrimitiveCache3DStats stats;
+};
+
+size_t PrimitiveEntry_bytes(long count) {
+    return sizeof(PrimitiveEntry) + count * sizeof(Triangle3D);
+}
+
+// the size of a packed triangle array (never 0 so that it can be allocated)
+size_t PackedTriangles_bytes(long count) {
+    return sizeof(Triangle3D) * (count > 0? count: 1);
+}
+
+int PrimitiveKey_equal(const PrimitiveKey* lhs, const PrimitiveKey* rhs) {
+    return lhs->kind == rhs->kind && lhs->levels == rhs->levels
+        && lhs->a == rhs->a && lhs->b == rhs->b;
+}
+
+/**
+ * @brief The primitive key describes, placed at origin.
+ */
+Primitive3D PrimitiveKey_primitive(const PrimitiveKey* key, Coordinate3D origin) {
+    Primitive3D primitive = {.origin = origin};
+    if(key->kind == PRIMITIVE_CACHE_SPHERE) {
+        primitive.kind = PRIMITIVE3D_SPHERE;
+        primitive.sphere.radius = key->a;
+        primitive.sphere.increment = key->b;
+    } else {
+        primitive.kind = PRIMITIVE3D_FRACTAL;
+        primitive.fractal.size = key->a;
+        primitive.fractal.levels = key->levels;
+    }
+    return primitive;
+}
+
+/**
+ * @brief Number of triangles the factory makes for key at most (a sphere's
+ * degenerate quadrilaterals at the poles only add one).
+ *
+ * @return long the count, or -1 if key's kind or parameters are invalid
+ */
+long PrimitiveKey_triangles(const PrimitiveKey* key) {
+    if(key->kind != PRIMITIVE_CACHE_SPHERE && key->kind != PRIMITIVE_CACHE_FRACTAL) {
+        return -1;
+    }
+    Primitive3D primitive = PrimitiveKey_primitive(key, (Coordinate3D){0.0, 0.0, 0.0});
+    return Primitive3D_triangles(&primitive);
+}
+
+Object3D* PrimitiveKey_build(const PrimitiveKey* key, Coordinate3D origin) {
+    Primitive3D primitive = PrimitiveKey_primitive(key, origin);
+    return Primitive3D_create(&primitive);
+}
+
+void PrimitiveCache3D_unlink(PrimitiveCache3D* cache, PrimitiveEntry* entry) {
+    if(entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if(entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+void PrimitiveCache3D_push_front(PrimitiveCache3D* cache, PrimitiveEntry* entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if(cache->head != NULL) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+/**
+ * @brief Evicts least recently used entries that nobody is copying from
+ * until `incoming` more bytes fit. Called with the lock held.
+ */
+void PrimitiveCache3D_evict(PrimitiveCache3D* cache, size_t incoming) {
+    PrimitiveEntry* prev;
+    for(PrimitiveEntry* entry = cache->tail;
+        entry != NULL && cache->stats.bytes + incoming > cache->max_bytes;
+        entry = prev)
+    {
+        prev = entry->prev;
+        if(entry->refs > 0) {
+            continue;
+        }
+        PrimitiveCache3D_unlink(cache, entry);
+        cache->stats.bytes -= PrimitiveEntry_bytes(entry->count);
+        --cache->stats.entries;
+        ++cache->stats.evictions;
+        mem3d_free(NULL, entry->triangles, PackedTriangles_bytes(entry->count));
+        mem3d_free(NULL, entry, sizeof(PrimitiveEntry));
+    }
+}
+
+/**
+ * @brief Takes ownership of a packed mesh and files it under key, unless
+ * an equal entry got there first. Called with the lock held.
+ *
+ * @return PrimitiveEntry* the entry now holding key, or NULL if the mesh
+ * does not fit, even after evicting every entry that nobody is copying
+ * from (triangles is freed in both of those cases)
+ */
+PrimitiveEntry* PrimitiveCache3D_insert(PrimitiveCache3D* cache,
+    const PrimitiveKey* key, Triangle3D* triangles, long count)
+{
+    for(PrimitiveEntry* entry = cache->head; entry != NULL; entry = entry->next) {
+        if(PrimitiveKey_equal(&entry->key, key)) {
+            mem3d_free(NULL, triangles, PackedTriangles_bytes(count));
+            return entry;
+        }
+    }
+    size_t bytes = PrimitiveEntry_bytes(count);
+    PrimitiveEntry* entry = bytes <= cache->max_bytes? mem3d_malloc(NULL, sizeof(PrimitiveEntry)): NULL;
+    if(entry == NULL) {
+        mem3d_free(NULL, triangles, PackedTriangles_bytes(count));
+        return NULL;
+    }
+    PrimitiveCache3D_evict(cache, bytes);
+    if(cache->stats.bytes + bytes > cache->max_bytes) {
+        // the rest is pinned by copies in progress; stay within max_bytes
+        mem3d_free(NULL, entry, sizeof(PrimitiveEntry));
+        mem3d_free(NULL, triangles, PackedTriangles_bytes(count));
+        return NULL;
+    }
+    entry->key = *key;
+    entry->count = count;
+    entry->triangles = triangles;
+    entry->refs = 0;
+    PrimitiveCache3D_push_front(cache, entry);
+    cache->stats.bytes += bytes;
+    ++cache->stats.entries;
+    return entry;
+}
+
+PrimitiveCache3D* PrimitiveCache3D_create(size_t max_bytes) {
+    PrimitiveCache3D* cache = mem3d_calloc(NULL, 1, sizeof(PrimitiveCache3D));
+    if(cache == NULL) {
+        return NULL;
+    }
+    if(mtx_init(&cache->lock, mtx_plain) != thrd_success) {
+        mem3d_free(NULL, cache, sizeof(PrimitiveCache3D));
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void PrimitiveCache3D_destroy(PrimitiveCache3D* cache) {
+    if(cache == NULL) {
+        return;
+    }
+    PrimitiveEntry* next;
+    for(PrimitiveEntry* entry = cache->head; entry != NULL; entry = next) {
+        next = entry->next;
+        mem3d_free(NULL, entry->triangles, PackedTriangles_bytes(entry->count));
+        mem3d_free(NULL, entry, sizeof(PrimitiveEntry));
+    }
+    mtx_destroy(&cache->lock);
+    mem3d_free(NULL, cache, sizeof(PrimitiveCache3D));
+}
+
+/**
+ * @brief Copies the packed object triangles into a new array, in order.
+ *
+ * @return Triangle3D* the array, or NULL if allocation failed
+ */
+Triangle3D* Object3D_pack(const Object3D* object) {
+    Triangle3D* triangles = mem3d_malloc(NULL, PackedTriangles_bytes(object->count));
+    if(triangles == NULL) {
+        return NULL;
+    }
+    Triangle3DIterator iter;
+    Triangle3DIterator_init(&iter, object);
+    Triangle3D* out = triangles;
+    while(Triangle3DIterator_next(&iter, out)) {
+        ++out;
+    }
+    return triangles;
+}
+
+Coordinate3D Coordinate3D_translate(Coordinate3D c, Coordinate3D origin) {
+    return (Coordinate3D){origin.x + c.x, origin.y + c.y, origin.z + c.z};
+}
+
+/**
+ * @brief Serves key at origin: a translated copy of the cached entry, or a
+ * freshly built canonical mesh that is cached (if there is room) and then
+ * moved to origin.
+ */
+Object3D* PrimitiveCache3D_get(PrimitiveCache3D* cache,
+    const PrimitiveKey* key, Coordinate3D origin)
+{
+    long bound = PrimitiveKey_triangles(key);
+    if(bound < 0) {
+        return NULL;
+    }
+    if(cache == NULL || PrimitiveEntry_bytes(bound) > cache->max_bytes) {
+        return PrimitiveKey_build(key, origin);
+    }
+    mtx_lock(&cache->lock);
+    PrimitiveEntry* entry = cache->head;
+    while(entry != NULL && !PrimitiveKey_equal(&entry->key, key)) {
+        entry = entry->next;
+    }
+    if(entry != NULL) {
+        ++cache->stats.hits;
+        ++entry->refs;
+        PrimitiveCache3D_unlink(cache, entry);
+        PrimitiveCache3D_push_front(cache, entry);
+        mtx_unlock(&cache->lock);
+
+        // copy outside of the lock; refs keeps the entry alive
+        Object3D* object = Object3D_empty_ctor();
+        for(long i = 0; object != NULL && i < entry->count; ++i) {
+            const Triangle3D* t = &entry->triangles[i];
+            if(Object3D_append_triangle(object, (Triangle3D){
+                Coordinate3D_translate(t->a, origin),
+                Coordinate3D_translate(t->b, origin),
+                Coordinate3D_translate(t->c, origin)
+            }) != 0) {
+                Object3D_dtor(object);
+                object = NULL;
+            }
+        }
+
+        mtx_lock(&cache->lock);
+        --entry->refs;
+        PrimitiveCache3D_evict(cache, 0);
+        mtx_unlock(&cache->lock);
+        return object;
+    }
+    ++cache->stats.misses;
+    mtx_unlock(&cache->lock);
+
+    // build outside of the lock; if another thread builds the same shape
+    // meanwhile, the first one to insert it wins
+    Object3D* object = PrimitiveKey_build(key, (Coordinate3D){0.0, 0.0, 0.0});
+    if(object == NULL) {
+        return NULL;
+    }
+    Triangle3D* triangles = Object3D_pack(object);
+    if(triangles != NULL) {
+        mtx_lock(&cache->lock);
+        PrimitiveCache3D_insert(cache, key, triangles, object->count);
+        mtx_unlock(&cache->lock);
+    }
+    for(Triangle3DNode* node = object->root; node != NULL; node = node->next) {
+        node->triangle.a = Coordinate3D_translate(node->triangle.a, origin);
+        node->triangle.b = Coordinate3D_translate(node->triangle.b, origin);
+        node->triangle.c = Coordinate3D_translate(node->triangle.c, origin);
+    }
+    return object;
+}
+
+Object3D* PrimitiveCache3D_create_sphere(PrimitiveCache3D* cache,
+    Coordinate3D origin, double radius, double increment)
+{
+    PrimitiveKey key = {PRIMITIVE_CACHE_SPHERE, 0, radius, increment};
+    return PrimitiveCache3D_get(cache, &key, origin);
+}
+
+Object3D* PrimitiveCache3D_create_fractal(PrimitiveCache3D* cache,
+    Coordinate3D origin, double size, int levels)
+{
+    PrimitiveKey key = {PRIMITIVE_CACHE_FRACTAL, levels, size, 0.0};
+    return PrimitiveCache3D_get(cache, &key, origin);
+}
+
+/**
+ * The cache file is the magic followed by the entries from least to most
+ * recently used (so loading them back restores the order), each being
+ *   uint32 kind, int32 levels, double a, double b, uint64 count,
+ *   count * 9 doubles
+ * all little-endian.
+ */
+int PrimitiveCache3D_save(PrimitiveCache3D* cache, const char* file_name) {
+    FILE* f = fopen(file_name, "wb");
+    if(f == NULL) {
+        return -1;
+    }
+    int status = fwrite(PRIMITIVE_CACHE_MAGIC, 1, 8, f) == 8? 0: -1;
+    unsigned char buffer[PRIMITIVE_CACHE_ENTRY_HEADER_LEN];
+    mtx_lock(&cache->lock);
+    for(PrimitiveEntry* entry = cache->tail; status == 0 && entry != NULL; entry = entry->prev) {
+        put_le32(buffer, entry->key.kind);
+        put_le32(buffer + 4, (uint32_t)entry->key.levels);
+        put_le_double(buffer + 8, entry->key.a);
+        put_le_double(buffer + 16, entry->key.b);
+        put_le32(buffer + 24, (uint32_t)entry->count);
+        put_le32(buffer + 28, (uint32_t)((uint64_t)entry->count >> 32));
+        status = fwrite(buffer, 1, sizeof(buffer), f) == sizeof(buffer)? 0: -1;
+        for(long i = 0; status == 0 && i < entry->count; ++i) {
+            unsigned char t[PRIMITIVE_CACHE_TRIANGLE_LEN];
+            const Triangle3D* triangle = &entry->triangles[i];
+            const Coordinate3D* c[3] = {&triangle->a, &triangle->b, &triangle->c};
+            for(int k = 0; k < 3; ++k) {
+                put_le_double(t + k * 24, c[k]->x);
+                put_le_double(t + k * 24 + 8, c[k]->y);
+                put_le_double(t + k * 24 + 16, c[k]->z);
+            }
+            status = fwrite(t, 1, sizeof(t), f) == sizeof(t)? 0: -1;
+        }
+    }
+    mtx_unlock(&cache->lock);
+    if(fclose(f) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+int PrimitiveCache3D_load(PrimitiveCache3D* cache, const char* file_name) {
+    FILE* f = fopen(file_name, "rb");
+    if(f == NULL) {
+        return -1;
+    }
+    char magic[8];
+    int status = fread(magic, 1, 8, f) == 8 && !memcmp(magic, PRIMITIVE_CACHE_MAGIC, 8)? 0: -1;
+    unsigned char buffer[PRIMITIVE_CACHE_ENTRY_HEADER_LEN];
+    while(status == 0 && fread(buffer, 1, sizeof(buffer), f) == sizeof(buffer)) {
+        PrimitiveKey key;
+        key.kind = get_le32(buffer);
+        key.levels = (int32_t)get_le32(buffer + 4);
+        key.a = get_le_double(buffer + 8);
+        key.b = get_le_double(buffer + 16);
+        uint64_t count = get_le32(buffer + 24) | (uint64_t)get_le32(buffer + 28) << 32;
+        // corrupt parameters or count are caught here, before they turn into
+        // endless counting loops or a huge malloc
+        long bound = PrimitiveKey_triangles(&key);
+        if(bound < 0 || count > (uint64_t)bound) {
+            status = -1;
+            break;
+        }
+        Triangle3D* triangles = mem3d_malloc(NULL, PackedTriangles_bytes((long)count));
+        if(triangles == NULL) {
+            status = -1;
+            break;
+        }
+        for(uint64_t i = 0; status == 0 && i < count; ++i) {
+            unsigned char t[PRIMITIVE_CACHE_TRIANGLE_LEN];
+            if(fread(t, 1, sizeof(t), f) != sizeof(t)) {
+                status = -1;
+                break;
+            }
+            Coordinate3D* c[3] = {&triangles[i].a, &triangles[i].b, &triangles[i].c};
+            for(int k = 0; k < 3; ++k) {
+                c[k]->x = get_le_double(t + k * 24);
+                c[k]->y = get_le_double(t + k * 24 + 8);
+                c[k]->z = get_le_double(t + k * 24 + 16);
+            }
+        }
+        if(status != 0) {
+            mem3d_free(NULL, triangles, PackedTriangles_bytes((long)count));
+            break;
+        }
+        mtx_lock(&cache->lock);
+        PrimitiveCache3D_insert(cache, &key, triangles, (long)count);
+        mtx_unlock(&cache->lock);
+    }
+    if(ferror(f)) {
+        status = -1;
+    }
+    fclose(f);
+    return status;
+}
+
+void PrimitiveCache3D_stats(PrimitiveCache3D* cache, PrimitiveCache3DStats* out) {
+    mtx_lock(&cache->lock);
+    *out = cache->stats;
+    mtx_unlock(&cache->lock);
+}
@@ -0,0 +1,446 @@
+/**
+ * @file 3d_dedup.c
+ * @author Pegasust
+ * @brief A source file for removing duplicate triangles from a Scene3D, e.g.
+ * the coincident faces that pile up when overlapping objects are merged
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "3d.h"
+
+// below this many triangles per thread, extra threads cost more than they save
+#define DEDUP_MIN_TRIANGLES_PER_THREAD 16384
+// coordinates this many grid steps away from 0 do not fit an int64 step count
+#define DEDUP_MAX_STEPS 4.0e18
+
+/**
+ * A triangle reduced to what makes it a duplicate: its corners snapped to
+ * the grid and sorted, so every winding and starting corner of the same
+ * vertex set gets the same key. Bit k of raw is set when v[k] holds the bit
+ * pattern of a coordinate too far out to be snapped, which keeps it from
+ * ever matching a snapped one.
+ */
+typedef struct DedupKey {
+    int64_t v[9];
+    uint32_t raw;
+} DedupKey;
+
+typedef struct DedupVertex {
+    int64_t c[3];
+    uint32_t raw;
+} DedupVertex;
+
+/**
+ * The state shared by the threads of one dedup pass. Each phase hands out
+ * work (objects or partitions) through an atomic counter, so the calling
+ * thread alone finishes a phase if no worker could be started.
+ * bucketed holds the triangle indices of partition p, ascending, from
+ * bucket_offsets[p] to bucket_offsets[p + 1]. cursors (scene->count rows of
+ * partitions entries) first count each object's triangles per partition,
+ * then hold where the object's next one goes.
+ */
+typedef struct DedupPass {
+    Scene3D* scene;
+    double tolerance;
+    long total;
+    long* offsets;
+    DedupKey* keys;
+    uint64_t* hashes;
+    long* cursors;
+    long* bucket_offsets;
+    long* bucketed;
+    unsigned char* removed;
+    long* removed_per_object;
+    QTriangle3D** packed;
+    int partitions;
+    _Atomic long next;
+    atomic_int failed;
+} DedupPass;
+
+/**
+ * @brief Snaps one coordinate to a step count on the tolerance grid, or
+ * takes its bit pattern when tolerance is 0 or the coordinate is too far out.
+ *
+ * @return int 1 if out holds raw bits, 0 if it holds a step count
+ */
+int dedup_snap(double value, double tolerance, int64_t* out) {
+    double steps = tolerance > 0.0? value / tolerance: NAN;
+    if(fabs(steps) < DEDUP_MAX_STEPS) {
+        *out = llround(steps);
+        return 0;
+    }
+    // + 0.0 folds -0.0 into 0.0 so they compare equal
+    value += 0.0;
+    memcpy(out, &value, sizeof(*out));
+    return 1;
+}
+
+DedupVertex dedup_vertex(Coordinate3D c, double tolerance) {
+    DedupVertex v;
+    v.raw = dedup_snap(c.x, tolerance, &v.c[0])
+        | dedup_snap(c.y, tolerance, &v.c[1]) << 1
+        | dedup_snap(c.z, tolerance, &v.c[2]) << 2;
+    return v;
+}
+
+int DedupVertex_compare(const DedupVertex* lhs, const DedupVertex* rhs) {
+    for(int k = 0; k < 3; ++k) {
+        if(lhs->c[k] != rhs->c[k]) {
+            return lhs->c[k] < rhs->c[k]? -1: 1;
+        }
+    }
+    return (lhs->raw > rhs->raw) - (lhs->raw < rhs->raw);
+}
+
+void DedupVertex_order(DedupVertex* lhs, DedupVertex* rhs) {
+    if(DedupVertex_compare(lhs, rhs) > 0) {
+        DedupVertex t = *lhs;
+        *lhs = *rhs;
+        *rhs = t;
+    }
+}
+
+/**
+ * @brief Builds the canonical key of a triangle.
+ */
+void DedupKey_from_triangle(DedupKey* key, const Triangle3D* t, double tolerance) {
+    DedupVertex v[3] = {
+        dedup_vertex(t->a, tolerance),
+        dedup_vertex(t->b, tolerance),
+        dedup_vertex(t->c, tolerance)
+    };
+    DedupVertex_order(&v[0], &v[1]);
+    DedupVertex_order(&v[1], &v[2]);
+    DedupVertex_order(&v[0], &v[1]);
+    key->raw = 0;
+    for(int i = 0; i < 3; ++i) {
+        memcpy(&key->v[i * 3], v[i].c, sizeof(v[i].c));
+        key->raw |= v[i].raw << (i * 3);
+    }
+}
+
+int DedupKey_equal(const DedupKey* lhs, const DedupKey* rhs) {
+    return lhs->raw == rhs->raw && !memcmp(lhs->v, rhs->v, sizeof(lhs->v));
+}
+
+uint64_t DedupKey_hash(const DedupKey* key) {
+    uint64_t h = key->raw * 0x9E3779B97F4A7C15ull;
+    for(int i = 0; i < 9; ++i) {
+        h ^= (uint64_t)key->v[i];
+        h *= 0xC2B2AE3D27D4EB4Full;
+        h ^= h >> 29;
+    }
+    h ^= h >> 32;
+    return h;
+}
+
+// the partition that owns a key; the table slot comes from the low bits
+long dedup_partition(uint64_t hash, int partitions) {
+    return (long)(hash >> 32) % partitions;
+}
+
+/**
+ * @brief Phase 1: keys every triangle, an object at a time, and counts the
+ * object's keys per partition.
+ */
+int DedupPass_key(void* arg) {
+    DedupPass* pass = arg;
+    Scene3D* scene = pass->scene;
+    for(long o; (o = atomic_fetch_add(&pass->next, 1)) < scene->count;) {
+        long i = pass->offsets[o];
+        long* counts = &pass->cursors[o * pass->partitions];
+        Triangle3DIterator iter;
+        Triangle3D triangle;
+        Triangle3DIterator_init(&iter, scene->objects[o]);
+        while(Triangle3DIterator_next(&iter, &triangle)) {
+            DedupKey_from_triangle(&pass->keys[i], &triangle, pass->tolerance);
+            pass->hashes[i] = DedupKey_hash(&pass->keys[i]);
+            ++counts[dedup_partition(pass->hashes[i], pass->partitions)];
+            ++i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns the per object counts into where each object's keys start
+ * in every partition's bucket, objects in scene order.
+ */
+void DedupPass_prefix_sum(DedupPass* pass) {
+    long start = 0;
+    for(long p = 0; p < pass->partitions; ++p) {
+        pass->bucket_offsets[p] = start;
+        for(long o = 0; o < pass->scene->count; ++o) {
+            long* cursor = &pass->cursors[o * pass->partitions + p];
+            long count = *cursor;
+            *cursor = start;
+            start += count;
+        }
+    }
+    pass->bucket_offsets[pass->partitions] = start;
+}
+
+/**
+ * @brief Phase 2: scatters the keys into their partition's bucket, an
+ * object at a time. Each object fills its own ranges, in order, so every
+ * bucket ends up in scene order.
+ */
+int DedupPass_scatter(void* arg) {
+    DedupPass* pass = arg;
+    Scene3D* scene = pass->scene;
+    for(long o; (o = atomic_fetch_add(&pass->next, 1)) < scene->count;) {
+        long* cursors = &pass->cursors[o * pass->partitions];
+        for(long i = pass->offsets[o]; i < pass->offsets[o + 1]; ++i) {
+            pass->bucketed[cursors[dedup_partition(pass->hashes[i], pass->partitions)]++] = i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Phase 3: each partition walks its bucket in scene order through its
+ * own open addressing table, so the first of each set of duplicates is the
+ * one kept without any locking.
+ */
+int DedupPass_mark(void* arg) {
+    DedupPass* pass = arg;
+    MemoryBudget3D* budget = pass->scene->budget;
+    for(long p; (p = atomic_fetch_add(&pass->next, 1)) < pass->partitions;) {
+        const long* bucket = &pass->bucketed[pass->bucket_offsets[p]];
+        long owned = pass->bucket_offsets[p + 1] - pass->bucket_offsets[p];
+        size_t slots = 16;
+        while(slots < (size_t)owned * 2) {
+            slots *= 2;
+        }
+        // slots hold index + 1 so that 0 marks an empty slot
+        long* table = mem3d_calloc(budget, slots, sizeof(long));
+        if(table == NULL) {
+            atomic_store(&pass->failed, 1);
+            return -1;
+        }
+        for(long b = 0; b < owned; ++b) {
+            long i = bucket[b];
+            size_t s = pass->hashes[i] & (slots - 1);
+            for(; table[s] != 0; s = (s + 1) & (slots - 1)) {
+                long seen = table[s] - 1;
+                if(pass->hashes[seen] == pass->hashes[i]
+                && DedupKey_equal(&pass->keys[seen], &pass->keys[i])) {
+                    pass->removed[i] = 1;
+                    break;
+                }
+            }
+            if(table[s] == 0) {
+                table[s] = i + 1;
+            }
+        }
+        mem3d_free(budget, table, slots * sizeof(long));
+    }
+    return 0;
+}
+
+size_t dedup_packed_size(long kept) {
+    return sizeof(QTriangle3D) * (kept > 0? kept: 1);
+}
+
+/**
+ * @brief Phase 4: allocates the compacted array of every quantized object
+ * that loses triangles, so that the drop phase cannot fail half way through
+ * the scene. removed_per_object is set for those objects.
+ */
+int DedupPass_reserve(void* arg) {
+    DedupPass* pass = arg;
+    Scene3D* scene = pass->scene;
+    for(long o; (o = atomic_fetch_add(&pass->next, 1)) < scene->count;) {
+        Object3D* object = scene->objects[o];
+        const unsigned char* removed = &pass->removed[pass->offsets[o]];
+        if(object->quantized == NULL) {
+            continue;
+        }
+        long dropped = 0;
+        for(long k = 0; k < object->count; ++k) {
+            dropped += removed[k];
+        }
+        pass->removed_per_object[o] = dropped;
+        if(dropped == 0) {
+            continue;
+        }
+        pass->packed[o] = mem3d_malloc(object->budget, dedup_packed_size(object->count - dropped));
+        if(pass->packed[o] == NULL) {
+            atomic_store(&pass->failed, 1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Drops the marked triangles of a quantized object by compacting its
+ * packed array into packed, which holds the kept triangles.
+ *
+ * @return long the number of triangles removed
+ */
+long Object3D_drop_quantized(Object3D* object, const unsigned char* removed, QTriangle3D* packed) {
+    size_t old_size = Object3D_quantized_size(object);
+    long j = 0;
+    for(long k = 0; k < object->count; ++k) {
+        if(!removed[k]) {
+            packed[j++] = object->quantized[k];
+        }
+    }
+    mem3d_free(object->budget, object->quantized, old_size);
+    object->quantized = packed;
+    long dropped = object->count - j;
+    object->count = j;
+    return dropped;
+}
+
+/**
+ * @brief Unlinks and frees the marked nodes of an object.
+ *
+ * @return long the number of triangles removed
+ */
+long Object3D_drop_nodes(Object3D* object, const unsigned char* removed) {
+    long dropped = 0;
+    long k = 0;
+    Triangle3DBlockIndex index;
+    Triangle3DBlockIndex_init(&index, object);
+    Triangle3DNode* prev = NULL;
+    Triangle3DNode* next;
+    for(Triangle3DNode* node = object->root; node != NULL; node = next, ++k) {
+        next = node->next;
+        if(!removed[k]) {
+            prev = node;
+            continue;
+        }
+        if(prev == NULL) {
+            object->root = next;
+        } else {
+            prev->next = next;
+        }
+        Object3D_release_node(object, &index, node);
+        ++dropped;
+    }
+    Triangle3DBlockIndex_destroy(&index);
+    object->tail = prev;
+    object->count -= dropped;
+    return dropped;
+}
+
+/**
+ * @brief Phase 5: removes the marked triangles, an object at a time.
+ */
+int DedupPass_drop(void* arg) {
+    DedupPass* pass = arg;
+    Scene3D* scene = pass->scene;
+    for(long o; (o = atomic_fetch_add(&pass->next, 1)) < scene->count;) {
+        Object3D* object = scene->objects[o];
+        const unsigned char* removed = &pass->removed[pass->offsets[o]];
+        long dropped = 0;
+        if(object->quantized == NULL) {
+            dropped = Object3D_drop_nodes(object, removed);
+        } else if(pass->packed[o] != NULL) {
+            dropped = Object3D_drop_quantized(object, removed, pass->packed[o]);
+        }
+        if(dropped > 0) {
+            Object3D_drop_encoded(object);
+            object->dirty = 1;
+        }
+        pass->removed_per_object[o] = dropped;
+    }
+    return 0;
+}
+
+long Scene3D_dedup_triangles(Scene3D* scene, double tolerance, int threads) {
+    if(!(tolerance >= 0.0) || isinf(tolerance)) {
+        return -1;
+    }
+    DedupPass pass;
+    memset(&pass, 0, sizeof(pass));
+    pass.scene = scene;
+    pass.tolerance = tolerance;
+    atomic_init(&pass.next, 0);
+    atomic_init(&pass.failed, 0);
+    MemoryBudget3D* budget = scene->budget;
+    size_t offsets_size = sizeof(long) * (scene->count + 1);
+    pass.offsets = mem3d_malloc(budget, offsets_size);
+    if(pass.offsets == NULL) {
+        return -1;
+    }
+    for(long o = 0; o < scene->count; ++o) {
+        pass.offsets[o] = pass.total;
+        pass.total += scene->objects[o]->count;
+    }
+    pass.offsets[scene->count] = pass.total;
+    if(pass.total < 2) {
+        mem3d_free(budget, pass.offsets, offsets_size);
+        return 0;
+    }
+    if(threads <= 0) {
+        threads = System3D_cpu_count();
+    }
+    long useful = pass.total / DEDUP_MIN_TRIANGLES_PER_THREAD + 1;
+    threads = threads < useful? threads: (int)useful;
+    threads = threads < SYSTEM3D_MAX_THREADS? threads: SYSTEM3D_MAX_THREADS;
+    pass.partitions = threads;
+
+    STATS_BEGIN(STATS3D_DEDUP);
+    long dropped = -1;
+    size_t cursors_size = sizeof(long) * scene->count * pass.partitions;
+    pass.keys = mem3d_malloc(budget, sizeof(DedupKey) * pass.total);
+    pass.hashes = mem3d_malloc(budget, sizeof(uint64_t) * pass.total);
+    pass.cursors = mem3d_calloc(budget, scene->count * pass.partitions, sizeof(long));
+    pass.bucket_offsets = mem3d_malloc(budget, sizeof(long) * (pass.partitions + 1));
+    pass.bucketed = mem3d_malloc(budget, sizeof(long) * pass.total);
+    pass.removed = mem3d_calloc(budget, pass.total, 1);
+    pass.removed_per_object = mem3d_calloc(budget, scene->count + 1, sizeof(long));
+    pass.packed = mem3d_calloc(budget, scene->count + 1, sizeof(QTriangle3D*));
+    if(pass.keys != NULL && pass.hashes != NULL && pass.cursors != NULL
+    && pass.bucket_offsets != NULL && pass.bucketed != NULL && pass.removed != NULL
+    && pass.removed_per_object != NULL && pass.packed != NULL) {
+        System3D_run_threads(threads, DedupPass_key, &pass);
+        DedupPass_prefix_sum(&pass);
+        atomic_store(&pass.next, 0);
+        System3D_run_threads(threads, DedupPass_scatter, &pass);
+        atomic_store(&pass.next, 0);
+        System3D_run_threads(threads, DedupPass_mark, &pass);
+        if(!atomic_load(&pass.failed)) {
+            atomic_store(&pass.next, 0);
+            System3D_run_threads(threads, DedupPass_reserve, &pass);
+        }
+        // nothing is removed unless every partition was marked and every
+        // compacted array allocated
+        if(atomic_load(&pass.failed)) {
+            for(long o = 0; o < scene->count; ++o) {
+                Object3D* object = scene->objects[o];
+                if(pass.packed[o] != NULL) {
+                    mem3d_free(object->budget, pass.packed[o],
+                        dedup_packed_size(object->count - pass.removed_per_object[o]));
+                }
+            }
+        } else {
+            atomic_store(&pass.next, 0);
+            System3D_run_threads(threads, DedupPass_drop, &pass);
+            dropped = 0;
+            for(long o = 0; o < scene->count; ++o) {
+                dropped += pass.removed_per_object[o];
+            }
+        }
+    }
+    mem3d_free(budget, pass.keys, sizeof(DedupKey) * pass.total);
+    mem3d_free(budget, pass.hashes, sizeof(uint64_t) * pass.total);
+    mem3d_free(budget, pass.cursors, cursors_size);
+    mem3d_free(budget, pass.bucket_offsets, sizeof(long) * (pass.partitions + 1));
+    mem3d_free(budget, pass.bucketed, sizeof(long) * pass.total);
+    mem3d_free(budget, pass.removed, pass.total);
+    mem3d_free(budget, pass.removed_per_object, offsets_size);
+    mem3d_free(budget, pass.packed, sizeof(QTriangle3D*) * (scene->count + 1));
+    mem3d_free(budget, pass.offsets, offsets_size);
+    STATS_END(STATS3D_DEDUP);
+    return dropped;
+}
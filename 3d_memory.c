@@ -0,0 +1,167 @@
+/**
+ * @file 3d_memory.c
+ * @author Pegasust
+ * @brief The allocator every part of the library goes through: sized
+ * malloc/calloc/realloc/free wrappers that charge a MemoryBudget3D, refuse
+ * allocations that would overdraw it and feed the allocation statistics
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "3d.h"
+
+struct MemoryBudget3D {
+    _Atomic size_t used;
+    size_t limit;
+};
+
+// the budget new objects and scenes made by this thread are charged to
+_Thread_local MemoryBudget3D* mem3d_bound = NULL;
+
+/**
+ * @brief Reserves size bytes of budget.
+ *
+ * @return int 0 on success (always for a NULL budget), -1 if that would
+ * go over the limit
+ */
+int MemoryBudget3D_charge(MemoryBudget3D* budget, size_t size) {
+    if(budget == NULL) {
+        return 0;
+    }
+    size_t used = atomic_fetch_add_explicit(&budget->used, size, memory_order_relaxed) + size;
+    if(used > budget->limit || used < size) {
+        atomic_fetch_sub_explicit(&budget->used, size, memory_order_relaxed);
+        return -1;
+    }
+    return 0;
+}
+
+void MemoryBudget3D_credit(MemoryBudget3D* budget, size_t size) {
+    if(budget != NULL) {
+        atomic_fetch_sub_explicit(&budget->used, size, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Moves size bytes that are already allocated from one budget to
+ * another (e.g. nodes spliced into an object of another scene). The move
+ * is not refused even if it overdraws `to`.
+ */
+void MemoryBudget3D_transfer(MemoryBudget3D* from, MemoryBudget3D* to, size_t size) {
+    if(from == to) {
+        return;
+    }
+    MemoryBudget3D_credit(from, size);
+    if(to != NULL) {
+        atomic_fetch_add_explicit(&to->used, size, memory_order_relaxed);
+    }
+}
+
+void* mem3d_malloc_at(const char* site, MemoryBudget3D* budget, size_t size) {
+    if(MemoryBudget3D_charge(budget, size) != 0) {
+        return NULL;
+    }
+    void* ptr = malloc(size);
+    if(ptr == NULL) {
+        MemoryBudget3D_credit(budget, size);
+        return NULL;
+    }
+    STATS_ALLOC(site, size);
+    return ptr;
+}
+
+void* mem3d_calloc_at(const char* site, MemoryBudget3D* budget, size_t count, size_t size) {
+    if(size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    if(MemoryBudget3D_charge(budget, count * size) != 0) {
+        return NULL;
+    }
+    void* ptr = calloc(count, size);
+    if(ptr == NULL) {
+        MemoryBudget3D_credit(budget, count * size);
+        return NULL;
+    }
+    STATS_ALLOC(site, count * size);
+    return ptr;
+}
+
+/**
+ * @brief realloc for a block of old_size bytes. Like realloc, ptr stays
+ * valid (and charged as old_size) when this fails.
+ */
+void* mem3d_realloc_at(const char* site, MemoryBudget3D* budget, void* ptr,
+    size_t old_size, size_t new_size)
+{
+    if(new_size > old_size && MemoryBudget3D_charge(budget, new_size - old_size) != 0) {
+        return NULL;
+    }
+    void* grown = realloc(ptr, new_size);
+    if(grown == NULL) {
+        if(new_size > old_size) {
+            MemoryBudget3D_credit(budget, new_size - old_size);
+        }
+        return NULL;
+    }
+    if(new_size < old_size) {
+        MemoryBudget3D_credit(budget, old_size - new_size);
+    }
+    if(ptr != NULL) {
+        STATS_FREE(old_size);
+    }
+    STATS_ALLOC(site, new_size);
+    return grown;
+}
+
+/**
+ * @brief Frees a block of size bytes allocated against budget.
+ */
+void mem3d_free(MemoryBudget3D* budget, void* ptr, size_t size) {
+    if(ptr == NULL) {
+        return;
+    }
+    free(ptr);
+    MemoryBudget3D_credit(budget, size);
+    STATS_FREE(size);
+}
+
+// every allocation is counted against the function that made it
+#define mem3d_malloc(budget, size) mem3d_malloc_at(__func__, budget, size)
+#define mem3d_calloc(budget, count, size) mem3d_calloc_at(__func__, budget, count, size)
+#define mem3d_realloc(budget, ptr, old_size, new_size) \
+    mem3d_realloc_at(__func__, budget, ptr, old_size, new_size)
+
+MemoryBudget3D* MemoryBudget3D_create(size_t limit) {
+    MemoryBudget3D* budget = mem3d_malloc(NULL, sizeof(MemoryBudget3D));
+    if(budget == NULL) {
+        return NULL;
+    }
+    atomic_init(&budget->used, 0);
+    budget->limit = limit;
+    return budget;
+}
+
+void MemoryBudget3D_destroy(MemoryBudget3D* budget) {
+    mem3d_free(NULL, budget, sizeof(MemoryBudget3D));
+}
+
+size_t MemoryBudget3D_used(const MemoryBudget3D* budget) {
+    return atomic_load_explicit(&((MemoryBudget3D*)budget)->used, memory_order_relaxed);
+}
+
+size_t MemoryBudget3D_limit(const MemoryBudget3D* budget) {
+    return budget->limit;
+}
+
+MemoryBudget3D* MemoryBudget3D_bind(MemoryBudget3D* budget) {
+    MemoryBudget3D* previous = mem3d_bound;
+    mem3d_bound = budget;
+    return previous;
+}
+
+MemoryBudget3D* MemoryBudget3D_bound() {
+    return mem3d_bound;
+}
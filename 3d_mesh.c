@@ -0,0 +1,173 @@
+/**
+ * @file 3d_mesh.c
+ * @author Pegasust
+ * @brief A source file for welding the triangle soup of a Scene3D into an
+ * indexed mesh (shared vertices + faces) for the indexed output formats
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "3d.h"
+
+#define WELD_INITIAL_CAPACITY 1024
+
+/**
+ * @brief Hashes the bit patterns of a float vertex.
+ *
+ * @param bits the 3 components reinterpreted as uint32_t
+ * @return uint32_t
+ */
+uint32_t weld_hash(const uint32_t bits[3]) {
+    uint64_t h = bits[0] * 0x9E3779B97F4A7C15ull;
+    h ^= (h >> 29) ^ (bits[1] * 0xC2B2AE3D27D4EB4Full);
+    h ^= (h >> 32) ^ (bits[2] * 0x165667B19E3779F9ull);
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+/**
+ * An open addressing table from vertex bit patterns to the index of that
+ * vertex in the mesh. Slots hold index + 1 so that 0 marks an empty slot.
+ */
+typedef struct WeldTable {
+    uint32_t* slots;
+    uint32_t mask;
+} WeldTable;
+
+/**
+ * @brief Grows the table to twice its size, reinserting every vertex.
+ *
+ * @param table
+ * @param mesh
+ * @return int 0 on success, -1 if the new slots could not be allocated
+ */
+int WeldTable_grow(WeldTable* table, const IndexedMesh3D* mesh) {
+    uint32_t new_mask = table->mask * 2 + 1;
+    uint32_t* slots = mem3d_calloc(mesh->budget, (size_t)new_mask + 1, sizeof(uint32_t));
+    if(slots == NULL) {
+        return -1;
+    }
+    for(long v = 0; v < mesh->vertex_count; ++v) {
+        uint32_t bits[3];
+        memcpy(bits, &mesh->vertices[v*3], sizeof(bits));
+        uint32_t i = weld_hash(bits) & new_mask;
+        while(slots[i] != 0) {
+            i = (i + 1) & new_mask;
+        }
+        slots[i] = (uint32_t)v + 1;
+    }
+    mem3d_free(mesh->budget, table->slots, ((size_t)table->mask + 1) * sizeof(uint32_t));
+    table->slots = slots;
+    table->mask = new_mask;
+    return 0;
+}
+
+/**
+ * @brief Finds the index of c in the mesh, adding it as a new vertex if it
+ * has not been seen yet.
+ *
+ * @param table
+ * @param mesh
+ * @param c
+ * @param out_index
+ * @return int 0 on success, -1 if growing the table or vertices failed
+ */
+int IndexedMesh3D_weld_vertex(IndexedMesh3D* mesh, WeldTable* table,
+    Coordinate3D c, uint32_t* out_index)
+{
+    // + 0.0f folds -0.0 into 0.0 so they weld together
+    float v[3] = {(float)c.x + 0.0f, (float)c.y + 0.0f, (float)c.z + 0.0f};
+    uint32_t bits[3];
+    memcpy(bits, v, sizeof(bits));
+    uint32_t i = weld_hash(bits) & table->mask;
+    for(; table->slots[i] != 0; i = (i + 1) & table->mask) {
+        const float* existing = &mesh->vertices[(table->slots[i] - 1) * 3];
+        if(memcmp(existing, v, sizeof(v)) == 0) {
+            *out_index = table->slots[i] - 1;
+            return 0;
+        }
+    }
+    if(mesh->vertex_count == mesh->vertex_capacity) {
+        float* grown = mem3d_realloc(mesh->budget, mesh->vertices,
+            sizeof(float) * 3 * mesh->vertex_capacity,
+            sizeof(float) * 3 * mesh->vertex_capacity * 2);
+        if(grown == NULL) {
+            return -1;
+        }
+        mesh->vertices = grown;
+        mesh->vertex_capacity *= 2;
+    }
+    memcpy(&mesh->vertices[mesh->vertex_count * 3], v, sizeof(v));
+    table->slots[i] = (uint32_t)mesh->vertex_count + 1;
+    *out_index = (uint32_t)mesh->vertex_count;
+    ++mesh->vertex_count;
+    // keep the load factor at or below 1/2
+    if((uint64_t)mesh->vertex_count * 2 > table->mask) {
+        return WeldTable_grow(table, mesh);
+    }
+    return 0;
+}
+
+IndexedMesh3D* IndexedMesh3D_from_scene(Scene3D* scene) {
+    long face_count = 0;
+    for(long i = 0; i < scene->count; ++i) {
+        face_count += scene->objects[i]->count;
+    }
+    if(face_count > UINT32_MAX / 3) {
+        return NULL; // indices would not fit
+    }
+    STATS_BEGIN(STATS3D_WELD);
+    IndexedMesh3D* mesh = mem3d_malloc(scene->budget, sizeof(IndexedMesh3D));
+    if(mesh == NULL) {
+        STATS_END(STATS3D_WELD);
+        return NULL;
+    }
+    mesh->budget = scene->budget;
+    WeldTable table = {mem3d_calloc(mesh->budget, WELD_INITIAL_CAPACITY, sizeof(uint32_t)),
+        WELD_INITIAL_CAPACITY - 1};
+    mesh->vertex_count = 0;
+    mesh->vertex_capacity = WELD_INITIAL_CAPACITY / 2;
+    mesh->vertices = mem3d_malloc(mesh->budget, sizeof(float) * 3 * mesh->vertex_capacity);
+    mesh->face_count = face_count;
+    mesh->indices = mem3d_malloc(mesh->budget, sizeof(uint32_t) * 3 * (face_count > 0? face_count: 1));
+    if(table.slots == NULL || mesh->vertices == NULL || mesh->indices == NULL) {
+        goto fail;
+    }
+    uint32_t* index = mesh->indices;
+    for(long i = 0; i < scene->count; ++i) {
+        Triangle3DIterator iter;
+        Triangle3D triangle;
+        Triangle3DIterator_init(&iter, scene->objects[i]);
+        while(Triangle3DIterator_next(&iter, &triangle)) {
+            if(IndexedMesh3D_weld_vertex(mesh, &table, triangle.a, &index[0]) != 0
+            || IndexedMesh3D_weld_vertex(mesh, &table, triangle.b, &index[1]) != 0
+            || IndexedMesh3D_weld_vertex(mesh, &table, triangle.c, &index[2]) != 0) {
+                goto fail;
+            }
+            index += 3;
+        }
+    }
+    mem3d_free(mesh->budget, table.slots, ((size_t)table.mask + 1) * sizeof(uint32_t));
+    STATS_END(STATS3D_WELD);
+    return mesh;
+
+fail:
+    mem3d_free(mesh->budget, table.slots, ((size_t)table.mask + 1) * sizeof(uint32_t));
+    IndexedMesh3D_destroy(mesh);
+    STATS_END(STATS3D_WELD);
+    return NULL;
+}
+
+void IndexedMesh3D_destroy(IndexedMesh3D* mesh) {
+    if(mesh == NULL) {
+        return;
+    }
+    MemoryBudget3D* budget = mesh->budget;
+    mem3d_free(budget, mesh->vertices, sizeof(float) * 3 * mesh->vertex_capacity);
+    mem3d_free(budget, mesh->indices,
+        sizeof(uint32_t) * 3 * (mesh->face_count > 0? mesh->face_count: 1));
+    mem3d_free(budget, mesh, sizeof(IndexedMesh3D));
+}
@@ -9,6 +9,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include "3d.h"
 
 typedef char *OrientationStrEnum;
@@ -61,6 +62,15 @@ int orientation_from_str(OrientationStrEnum orientation) {
     return NO_MATCH;
 }
 
+int Orientation3D_parse(const char* name, Orientation3D* out) {
+    int orientation = orientation_from_str((OrientationStrEnum)name);
+    if(orientation == NO_MATCH) {
+        return -1;
+    }
+    *out = (Orientation3D)orientation;
+    return 0;
+}
+
 int orientation_axis(int orientation) {
     if(orientation == NO_MATCH) {return orientation;}
     return orientation % 3;
@@ -74,37 +84,66 @@ int orientation_match(OrientationStrEnum lhs, OrientationStrEnum rhs) {
     return !strcmp(lhs, rhs);
 }
 /**
- * @brief Merges by stealing root of `mover`. `mover` is effectively deallocated
- * 
- * @param merged 
- * @param mover 
- * @return Object3D* merged object that contains previously owned triangle
- * nodes from `mover`
+ * @brief Object3D_merge with the order of the two node lists chosen by the
+ * caller.
+ *
+ * @param merged
+ * @param mover
+ * @param mover_first whether the mover's triangles go before the merged ones
+ * @return Object3D* as Object3D_merge
  */
-Object3D *Object3D_merge(Object3D* merged, Object3D** mover) {
+Object3D *Object3D_merge_ordered(Object3D* merged, Object3D** mover, int mover_first) {
     if(mover == NULL || *mover == NULL) {
         return merged;
     }
     Object3D *mov = *mover;
-    // steal the mover's root
-    // we would do the minimum count for least traversal
-    // it's O(min(M,N))
-    Object3D *traverse = (mov->count < merged->count)? mov: merged;
+    // nodes can only be stolen from the linked list representation
+    if(Object3D_dequantize(merged) == NULL || Object3D_dequantize(mov) == NULL) {
+        return NULL;
+    }
+    // steal the mover's root; with tail pointers the splice is O(1)
+    Object3D *traverse = mover_first? mov: merged;
     Object3D *other = (Object3D*) (((uintptr_t)merged ^ (uintptr_t)mov) ^ (uintptr_t)traverse);
-    Triangle3DNode **trav_end;
-    for(trav_end = &traverse->root; *trav_end != NULL; trav_end = &((*trav_end)->next)) {
+    if(traverse->root == NULL) {
+        merged->root = other->root;
+        merged->tail = other->tail;
+    } else {
+        traverse->tail->next = other->root;
+        merged->root = traverse->root;
+        merged->tail = other->tail != NULL? other->tail: traverse->tail;
     }
-    *trav_end = other->root;
-    Triangle3DNode *new_node = traverse->root;
-    merged->root = new_node;
     // assign new count
     merged->count += mov->count;
+    merged->dirty = 1;
+    // the stolen nodes (and the blocks they live in) are now merged's to pay for
+    if(mov->budget != merged->budget) {
+        MemoryBudget3D_transfer(mov->budget, merged->budget, Object3D_node_bytes(mov));
+    }
+    Object3D_adopt_blocks(merged, mov);
     // deallocate mover (no dtor on root because we "stole" its root)
-    free(*mover);
+    Object3D_drop_encoded(mov);
+    mem3d_free(mov->budget, mov, sizeof(Object3D));
     *mover = NULL;
     return merged;
 }
 
+/**
+ * @brief Merges by stealing root of `mover`. `mover` is effectively deallocated
+ * 
+ * @param merged 
+ * @param mover 
+ * @return Object3D* merged object that contains previously owned triangle
+ * nodes from `mover`, or NULL if a quantized operand could not be expanded
+ * (both objects are then left with the caller)
+ */
+Object3D *Object3D_merge(Object3D* merged, Object3D** mover) {
+    if(mover == NULL || *mover == NULL) {
+        return merged;
+    }
+    // the shorter list goes first (this used to be the one we traversed)
+    return Object3D_merge_ordered(merged, mover, (*mover)->count < merged->count);
+}
+
 double* axis_value(Coordinate3D* coord, int axis) {
     switch(axis) {
         case AXIS_X:
@@ -174,7 +213,10 @@ struct RectangleCoords* RectangleCoords_create(Coordinate3D origin, double width
 
     *_modify_width(&bot_left, axis) -= width_offset;
     *_modify_height(&bot_left, axis) -= height_offset;
-    struct RectangleCoords* retval = malloc(sizeof(struct RectangleCoords));
+    struct RectangleCoords* retval = mem3d_malloc(NULL, sizeof(struct RectangleCoords));
+    if(retval == NULL) {
+        return NULL;
+    }
     retval->top_left = top_left;
     retval->bot_left = bot_left;
     retval->bot_right = bot_right;
@@ -186,21 +228,186 @@ Object3D *Object3D_create_rectangle(Coordinate3D origin, double width, double he
 
     Object3D *retval = Object3D_empty_ctor();
     struct RectangleCoords* c = RectangleCoords_create(origin, width, height, axis);
-
-    Object3D_append_quadrilateral(retval, c->top_left, c->top_right, c->bot_right, c->bot_left);
-    free(c);
+    if(retval == NULL || c == NULL
+    || Object3D_append_quadrilateral(retval, c->top_left, c->top_right, c->bot_right, c->bot_left) != 0) {
+        Object3D_dtor(retval);
+        retval = NULL;
+    }
+    mem3d_free(NULL, c, sizeof(struct RectangleCoords));
     return retval;
 }
 
+// Precomputed templates.
+// Every cuboid and every pyramid of one orientation comes out of the
+// rectangle + quadrilateral construction below with the same topology, so
+// the triangles it produces are tabulated here, in its order, as signs of
+// offsets from a face centre (dumped from that construction). Building from
+// a table skips the rectangles, the merges and the corner sorting but gives
+// the same coordinates bit for bit, provided the corner sort is not fooled by
+// rounding: every side must be well above its 0.001 threshold and the
+// origin small enough for the offsets to survive. Otherwise the factories
+// fall back to the construction.
+#define TEMPLATE_MIN_SIZE 0.01
+#define TEMPLATE_MAX_COORD 1e9
+
+#define CUBOID_BOTTOM 0
+#define CUBOID_TOP    1
+#define CUBOID_LEFT   2
+#define CUBOID_RIGHT  3
+#define CUBOID_BACK   4
+#define CUBOID_FRONT  5
+#define CUBOID_FACES  6
+
+struct TemplateTriangle {
+    int face;
+    signed char corners[3][3];
+};
+
+// (face, x/y/z sign of each corner)
+const struct TemplateTriangle CUBOID_TEMPLATE[12] = {
+    {CUBOID_FRONT,  {{-1, -1,  0}, {-1,  1,  0}, { 1, -1,  0}}},
+    {CUBOID_FRONT,  {{ 1,  1,  0}, {-1,  1,  0}, { 1, -1,  0}}},
+    {CUBOID_BACK,   {{-1, -1,  0}, {-1,  1,  0}, { 1, -1,  0}}},
+    {CUBOID_BACK,   {{ 1,  1,  0}, {-1,  1,  0}, { 1, -1,  0}}},
+    {CUBOID_RIGHT,  {{ 0, -1, -1}, { 0, -1,  1}, { 0,  1, -1}}},
+    {CUBOID_RIGHT,  {{ 0,  1,  1}, { 0, -1,  1}, { 0,  1, -1}}},
+    {CUBOID_LEFT,   {{ 0, -1, -1}, { 0, -1,  1}, { 0,  1, -1}}},
+    {CUBOID_LEFT,   {{ 0,  1,  1}, { 0, -1,  1}, { 0,  1, -1}}},
+    {CUBOID_BOTTOM, {{-1,  0, -1}, {-1,  0,  1}, { 1,  0, -1}}},
+    {CUBOID_BOTTOM, {{ 1,  0,  1}, {-1,  0,  1}, { 1,  0, -1}}},
+    {CUBOID_TOP,    {{-1,  0, -1}, {-1,  0,  1}, { 1,  0, -1}}},
+    {CUBOID_TOP,    {{ 1,  0,  1}, {-1,  0,  1}, { 1,  0, -1}}}
+};
+
+// per axis, for the orientation pointing the positive way; the other one
+// only flips the apex (the corner with a sign on the axis itself)
+const signed char PYRAMID_TEMPLATE[3][6][3][3] = {
+    { // AXIS_X
+        {{ 0,  1,  1}, { 0,  1, -1}, { 1,  0,  0}},
+        {{ 0, -1,  1}, { 0, -1, -1}, { 1,  0,  0}},
+        {{ 0, -1, -1}, { 0,  1, -1}, { 1,  0,  0}},
+        {{ 0, -1,  1}, { 0,  1,  1}, { 1,  0,  0}},
+        {{ 0, -1, -1}, { 0, -1,  1}, { 0,  1, -1}},
+        {{ 0,  1,  1}, { 0, -1,  1}, { 0,  1, -1}}
+    },
+    { // AXIS_Y
+        {{ 1,  0,  1}, {-1,  0,  1}, { 0,  1,  0}},
+        {{ 1,  0, -1}, {-1,  0, -1}, { 0,  1,  0}},
+        {{-1,  0, -1}, {-1,  0,  1}, { 0,  1,  0}},
+        {{ 1,  0, -1}, { 1,  0,  1}, { 0,  1,  0}},
+        {{-1,  0, -1}, {-1,  0,  1}, { 1,  0, -1}},
+        {{ 1,  0,  1}, {-1,  0,  1}, { 1,  0, -1}}
+    },
+    { // AXIS_Z
+        {{ 1,  1,  0}, { 1, -1,  0}, { 0,  0,  1}},
+        {{-1,  1,  0}, {-1, -1,  0}, { 0,  0,  1}},
+        {{-1, -1,  0}, { 1, -1,  0}, { 0,  0,  1}},
+        {{-1,  1,  0}, { 1,  1,  0}, { 0,  0,  1}},
+        {{-1, -1,  0}, {-1,  1,  0}, { 1, -1,  0}},
+        {{ 1,  1,  0}, {-1,  1,  0}, { 1, -1,  0}}
+    }
+};
+
+/**
+ * @brief center moved by extent in the direction of sign. A 0 sign keeps
+ * center as is (adding 0.0 would turn a -0.0 into 0.0).
+ */
+double template_offset(double center, int sign, double extent) {
+    return sign == 0? center: sign > 0? center + extent: center - extent;
+}
+
+Coordinate3D template_corner(Coordinate3D center, const signed char sign[3], const double extent[3]) {
+    return (Coordinate3D){
+        template_offset(center.x, sign[0], extent[0]),
+        template_offset(center.y, sign[1], extent[1]),
+        template_offset(center.z, sign[2], extent[2])
+    };
+}
+
+int template_origin_ok(Coordinate3D origin) {
+    return fabs(origin.x) < TEMPLATE_MAX_COORD && fabs(origin.y) < TEMPLATE_MAX_COORD
+        && fabs(origin.z) < TEMPLATE_MAX_COORD;
+}
+
 // Object3D factories
+Object3D *Object3D_create_pyramid_from_rectangle(Coordinate3D origin, double width, double height, int orientation);
+
 Object3D *Object3D_create_pyramid(Coordinate3D origin, double width, double height, OrientationStrEnum orientation_str) {
-    // create the 5 points of concerns:
-    Coordinate3D pyramid_top = origin;
     // decode where the pyramid points to (OK!)
     int orientation = orientation_from_str(orientation_str);
     if(orientation == NO_MATCH) {
         return NULL;
     }
+    return Object3D_create_pyramid_oriented(origin, width, height, (Orientation3D)orientation);
+}
+
+int Object3D_append_pyramid(Object3D* object, Coordinate3D origin, double width, double height, Orientation3D orientation);
+
+Object3D *Object3D_create_pyramid_oriented(Coordinate3D origin, double width, double height, Orientation3D orientation) {
+    if((unsigned)orientation >= ORIENTATION3D_COUNT) {
+        return NULL;
+    }
+    if(!(width >= TEMPLATE_MIN_SIZE) || !template_origin_ok(origin)) {
+        return Object3D_create_pyramid_from_rectangle(origin, width, height, orientation);
+    }
+    Object3D *pyramid = Object3D_empty_ctor();
+    if(pyramid != NULL && Object3D_append_pyramid(pyramid, origin, width, height, orientation) != 0) {
+        Object3D_dtor(pyramid);
+        pyramid = NULL;
+    }
+    return pyramid;
+}
+
+/**
+ * @brief Same as Object3D_create_pyramid_oriented, but appends the pyramid
+ * to object.
+ *
+ * @return int 0 on success, -1 if orientation is invalid or a triangle could
+ * not be allocated (object may hold part of the pyramid)
+ */
+int Object3D_append_pyramid(Object3D* object, Coordinate3D origin, double width, double height, Orientation3D orientation) {
+    if((unsigned)orientation >= ORIENTATION3D_COUNT) {
+        return -1;
+    }
+    if(!(width >= TEMPLATE_MIN_SIZE) || !template_origin_ok(origin)) {
+        Object3D *pyramid = Object3D_create_pyramid_from_rectangle(origin, width, height, orientation);
+        if(pyramid == NULL || Object3D_merge_ordered(object, &pyramid, 0) == NULL) {
+            Object3D_dtor(pyramid);
+            return -1;
+        }
+        return 0;
+    }
+    STATS_BEGIN(STATS3D_PYRAMID);
+    int axis = orientation_axis(orientation);
+    double extent[3] = {width/2.0, width/2.0, width/2.0};
+    extent[axis] = height;
+    int apex = positive_direction(orientation)? 1: -1;
+    int status = 0;
+    for(int t = 0; status == 0 && t < 6; ++t) {
+        Coordinate3D corners[3];
+        for(int i = 0; i < 3; ++i) {
+            signed char sign[3] = {
+                PYRAMID_TEMPLATE[axis][t][i][0],
+                PYRAMID_TEMPLATE[axis][t][i][1],
+                PYRAMID_TEMPLATE[axis][t][i][2]
+            };
+            sign[axis] *= apex;
+            corners[i] = template_corner(origin, sign, extent);
+        }
+        status = Object3D_append_triangle(object, (Triangle3D){corners[0], corners[1], corners[2]});
+    }
+    STATS_END(STATS3D_PYRAMID);
+    return status;
+}
+
+/**
+ * @brief The construction the pyramid template was dumped from, still used
+ * where the template does not apply.
+ */
+Object3D *Object3D_create_pyramid_from_rectangle(Coordinate3D origin, double width, double height, int orientation) {
+    // create the 5 points of concerns:
+    Coordinate3D pyramid_top = origin;
+    STATS_BEGIN(STATS3D_PYRAMID);
     int axis = orientation_axis(orientation);
     struct RectangleCoords * rect = RectangleCoords_create(origin, width, width, axis);
     // acquired the four points, now only need to calculate the top
@@ -209,19 +416,108 @@ Object3D *Object3D_create_pyramid(Coordinate3D origin, double width, double heig
 
     // emplace these points as triangles
     Object3D *pyramid = Object3D_empty_ctor();
-
-    Object3D_append_quadrilateral(pyramid, rect->top_left, rect->top_right, rect->bot_right, rect->bot_left);
-
+    if(pyramid == NULL || rect == NULL
+    || Object3D_append_quadrilateral(pyramid, rect->top_left, rect->top_right, rect->bot_right, rect->bot_left) != 0
     // triangle parts
-    Object3D_emplace_triangle(pyramid, rect->top_left, rect->top_right, pyramid_top);
-    Object3D_emplace_triangle(pyramid, rect->bot_left, rect->bot_right, pyramid_top);
-    Object3D_emplace_triangle(pyramid, rect->top_left, rect->bot_left, pyramid_top);
-    Object3D_emplace_triangle(pyramid, rect->top_right, rect->bot_right, pyramid_top);
-    free(rect);
+    || Object3D_emplace_triangle(pyramid, rect->top_left, rect->top_right, pyramid_top) == NULL
+    || Object3D_emplace_triangle(pyramid, rect->bot_left, rect->bot_right, pyramid_top) == NULL
+    || Object3D_emplace_triangle(pyramid, rect->top_left, rect->bot_left, pyramid_top) == NULL
+    || Object3D_emplace_triangle(pyramid, rect->top_right, rect->bot_right, pyramid_top) == NULL) {
+        Object3D_dtor(pyramid);
+        pyramid = NULL;
+    }
+    mem3d_free(NULL, rect, sizeof(struct RectangleCoords));
+    STATS_END(STATS3D_PYRAMID);
     return pyramid;
 }
 
+Object3D *Object3D_create_cuboid_from_rectangles(Coordinate3D origin, double width, double height, double depth);
+
+int cuboid_template_ok(Coordinate3D origin, double width, double height, double depth) {
+    return width >= TEMPLATE_MIN_SIZE && height >= TEMPLATE_MIN_SIZE && depth >= TEMPLATE_MIN_SIZE
+        && template_origin_ok(origin);
+}
+
 Object3D *Object3D_create_cuboid(Coordinate3D origin, double width, double height, double depth) {
+    if(!cuboid_template_ok(origin, width, height, depth)) {
+        return Object3D_create_cuboid_from_rectangles(origin, width, height, depth);
+    }
+    Object3D *cuboid = Object3D_empty_ctor();
+    if(cuboid != NULL && Object3D_append_cuboid(cuboid, origin, width, height, depth) != 0) {
+        Object3D_dtor(cuboid);
+        cuboid = NULL;
+    }
+    return cuboid;
+}
+
+int Object3D_append_cuboid(Object3D* object, Coordinate3D origin, double width, double height, double depth) {
+    if(!cuboid_template_ok(origin, width, height, depth)) {
+        // the construction's own merge order, with the cuboid going last
+        Object3D *cuboid = Object3D_create_cuboid_from_rectangles(origin, width, height, depth);
+        if(cuboid == NULL || Object3D_merge_ordered(object, &cuboid, 0) == NULL) {
+            Object3D_dtor(cuboid);
+            return -1;
+        }
+        return 0;
+    }
+    STATS_BEGIN(STATS3D_CUBOID);
+    double extent[3] = {width/2, height/2, depth/2};
+    double w = extent[0],
+           h = extent[1],
+           d = extent[2];
+    // the face centres, rounded exactly like the construction's origin
+    // walk (which moves the origin to each face and back)
+    Coordinate3D centers[CUBOID_FACES];
+    double y = origin.y - h + h,
+           x = origin.x - w + w;
+    centers[CUBOID_BOTTOM] = (Coordinate3D){origin.x, origin.y - h, origin.z};
+    centers[CUBOID_TOP] = (Coordinate3D){origin.x, y + h, origin.z};
+    y = y + h - h;
+    centers[CUBOID_LEFT] = (Coordinate3D){origin.x - w, y, origin.z};
+    centers[CUBOID_RIGHT] = (Coordinate3D){x + w, y, origin.z};
+    x = x + w - w;
+    centers[CUBOID_BACK] = (Coordinate3D){x, y, origin.z - d};
+    centers[CUBOID_FRONT] = (Coordinate3D){x, y, origin.z - d + d + d};
+    int status = 0;
+    for(int t = 0; status == 0 && t < 12; ++t) {
+        const struct TemplateTriangle* tt = &CUBOID_TEMPLATE[t];
+        Coordinate3D center = centers[tt->face];
+        status = Object3D_append_triangle(object, (Triangle3D){
+            template_corner(center, tt->corners[0], extent),
+            template_corner(center, tt->corners[1], extent),
+            template_corner(center, tt->corners[2], extent)
+        });
+    }
+    STATS_END(STATS3D_CUBOID);
+    return status;
+}
+
+/**
+ * @brief Merges `part` into `whole`, destroying both if either is missing or
+ * the merge fails.
+ *
+ * @return Object3D* the merged object, or NULL
+ */
+Object3D *Object3D_merge_or_drop(Object3D* whole, Object3D* part) {
+    if(whole == NULL || part == NULL) {
+        Object3D_dtor(whole);
+        Object3D_dtor(part);
+        return NULL;
+    }
+    if(Object3D_merge(whole, &part) == NULL) {
+        Object3D_dtor(whole);
+        Object3D_dtor(part);
+        return NULL;
+    }
+    return whole;
+}
+
+/**
+ * @brief The construction the cuboid template was dumped from, still used
+ * where the template does not apply.
+ */
+Object3D *Object3D_create_cuboid_from_rectangles(Coordinate3D origin, double width, double height, double depth) {
+    STATS_BEGIN(STATS3D_CUBOID);
     // assemble 6 rectangles
     double w = width/2,
            h = height/2,
@@ -234,28 +530,29 @@ Object3D *Object3D_create_cuboid(Coordinate3D origin, double width, double heigh
     // top
     origin.y += h;
     temp = Object3D_create_rectangle(origin, depth, width, AXIS_Y);
-    cuboid = Object3D_merge(cuboid, &temp);
+    cuboid = Object3D_merge_or_drop(cuboid, temp);
     origin.y -= h;
     // left
     origin.x -= w;
     temp = Object3D_create_rectangle(origin, height, depth, AXIS_X);
-    cuboid = Object3D_merge(cuboid, &temp);
+    cuboid = Object3D_merge_or_drop(cuboid, temp);
     origin.x += w;
     // right
     origin.x += w;
     temp = Object3D_create_rectangle(origin, height, depth, AXIS_X);
-    cuboid = Object3D_merge(cuboid, &temp);
+    cuboid = Object3D_merge_or_drop(cuboid, temp);
     origin.x -= w;
     // backwards
     origin.z -= d;
     temp = Object3D_create_rectangle(origin, width, height, AXIS_Z);
-    cuboid = Object3D_merge(cuboid, &temp);
+    cuboid = Object3D_merge_or_drop(cuboid, temp);
     origin.z += d;
     // forwards
     origin.z += d;
     temp = Object3D_create_rectangle(origin, width, height, AXIS_Z);
-    cuboid = Object3D_merge(cuboid, &temp);
+    cuboid = Object3D_merge_or_drop(cuboid, temp);
     origin.z -= d;
+    STATS_END(STATS3D_CUBOID);
     return cuboid;
 }
 #define M_PI   3.14159265358979323846264338327950288
@@ -269,8 +566,26 @@ void Coordinate3D_from_spherical_coord(Coordinate3D *out, const Coordinate3D * o
     out->z = origin->z + (radius * cos(phi));
 }
 
+int Object3D_append_sphere(Object3D* sphere, Coordinate3D origin, double radius, double increment);
+
 Object3D* Object3D_create_sphere(Coordinate3D origin, double radius, double increment) {
     Object3D *sphere = Object3D_empty_ctor();
+    if(sphere != NULL && Object3D_append_sphere(sphere, origin, radius, increment) != 0) {
+        Object3D_dtor(sphere);
+        sphere = NULL;
+    }
+    return sphere;
+}
+
+/**
+ * @brief Same as Object3D_create_sphere, but appends the sphere to an
+ * existing object.
+ *
+ * @return int 0 on success, -1 if a triangle could not be allocated (sphere
+ * may hold part of the sphere)
+ */
+int Object3D_append_sphere(Object3D* sphere, Coordinate3D origin, double radius, double increment) {
+    STATS_BEGIN(STATS3D_SPHERE);
     for(double phi = increment; phi <= 180.0; phi += increment) {
         for(double theta = 0; theta < 360.0; theta += increment) {
             // create the rect
@@ -285,40 +600,328 @@ Object3D* Object3D_create_sphere(Coordinate3D origin, double radius, double incr
             Coordinate3D_from_spherical_coord(&ph_inc, &origin, radius, theta-increment, phi);
             Coordinate3D_from_spherical_coord(&next_s, &origin, radius, theta-increment, phi-increment);
 
-            Object3D_append_quadrilateral(sphere, start_, th_inc, ph_inc, next_s);
+            if(Object3D_append_quadrilateral(sphere, start_, th_inc, ph_inc, next_s) != 0) {
+                STATS_END(STATS3D_SPHERE);
+                return -1;
+            }
         }
     }
+    STATS_END(STATS3D_SPHERE);
+    return 0;
+}
 
-    return sphere;
+// more bands than this make more triangles than fit in memory anyway
+#define SPHERE_LOD_MAX_BANDS (1L << 15)
+
+/**
+ * The rings of a level-of-detail sphere: bands + 1 rings of equal latitude
+ * from pole to pole (the poles being rings of one vertex), each split into
+ * as few segments as keep neighbouring vertices within step radians.
+ */
+typedef struct SphereLOD {
+    long bands;
+    double step;
+    long max_segments;
+} SphereLOD;
+
+long SphereLOD_segments(const SphereLOD* lod, long ring) {
+    if(ring == 0 || ring == lod->bands) {
+        return 1;
+    }
+    double segments = ceil(2.0 * M_PI * sin(M_PI * ring / lod->bands) / lod->step);
+    return segments < 3? 3: (long)segments;
 }
 
-#include <assert.h>
-Object3D* Object3D_create_fractal(Coordinate3D origin, double size, int levels) {
-    assert(levels >= 0 && "Negative levels, no eligible object.");
-    if(levels == 0) {
-        return Object3D_empty_ctor(); // nothing to return from
+/**
+ * @brief Picks the rings for a sphere whose flat triangles stay within
+ * tolerance of the true surface.
+ * A triangle whose corners lie on the sphere strays from it by
+ * radius * (1 - cos(a)) at most, a being the angle from the centre to its
+ * circumcircle. Bands step apart and segments at most step wide make
+ * triangles of about two legs of step, whose circumcircle spans step / sqrt(2)
+ * when they are stitched along the shorter diagonal.
+ *
+ * @return int 0 on success, -1 if radius or tolerance are not usable
+ */
+int SphereLOD_init(SphereLOD* lod, double radius, double tolerance) {
+    if(!(radius > 0.0) || isinf(radius) || !(tolerance > 0.0)) {
+        return -1;
+    }
+    double cosine = 1.0 - tolerance / radius;
+    lod->step = sqrt(2.0) * acos(cosine > -1.0? cosine: -1.0);
+    // a tolerance lost to rounding next to the radius leaves no step
+    if(!(lod->step > 0.0) || ceil(M_PI / lod->step) > SPHERE_LOD_MAX_BANDS) {
+        return -1;
+    }
+    lod->bands = (long)ceil(M_PI / lod->step);
+    lod->bands = lod->bands < 2? 2: lod->bands;
+    lod->max_segments = 1;
+    for(long ring = 1; ring < lod->bands; ++ring) {
+        long segments = SphereLOD_segments(lod, ring);
+        lod->max_segments = segments > lod->max_segments? segments: lod->max_segments;
+    }
+    return 0;
+}
+
+long SphereLOD_triangles(const SphereLOD* lod) {
+    long triangles = 0;
+    for(long ring = 0; ring < lod->bands; ++ring) {
+        long upper = SphereLOD_segments(lod, ring);
+        long lower = SphereLOD_segments(lod, ring + 1);
+        triangles += (upper > 1? upper: 0) + (lower > 1? lower: 0);
+    }
+    return triangles;
+}
+
+/**
+ * @brief Fills out with the vertices of a ring, from theta = 0 on.
+ *
+ * @return long the number of vertices
+ */
+long SphereLOD_ring(const SphereLOD* lod, Coordinate3D origin, double radius,
+    long ring, Coordinate3D* out)
+{
+    long segments = SphereLOD_segments(lod, ring);
+    double phi = 180.0 * ring / lod->bands;
+    for(long i = 0; i < segments; ++i) {
+        Coordinate3D_from_spherical_coord(&out[i], &origin, radius, 360.0 * i / segments, phi);
+    }
+    return segments;
+}
+
+/**
+ * @brief Triangulates the band between two rings, upper being the one
+ * nearer to phi = 0. Both rings are walked from theta = 0 on, each step
+ * taking the shorter of the two diagonals ahead, and every vertex of either
+ * ring is a corner in the band, so bands meet without T-junctions.
+ * A ring of one vertex is a pole, around which the band becomes a fan.
+ * The triangles wind counter-clockwise seen from outside.
+ *
+ * @return int 0 on success, -1 if a triangle could not be allocated
+ */
+int Object3D_zip_rings(Object3D* object, const Coordinate3D* upper, long upper_count,
+    const Coordinate3D* lower, long lower_count)
+{
+    long i = 0, j = 0;
+    while(i < upper_count || j < lower_count) {
+        int advance_upper = j == lower_count || (i < upper_count
+            && Coordinate3D_distance(upper[(i + 1) % upper_count], lower[j])
+                <= Coordinate3D_distance(upper[i], lower[(j + 1) % lower_count]));
+        if(advance_upper) {
+            if(upper_count > 1 && Object3D_append_triangle(object, (Triangle3D){
+                upper[i], lower[j % lower_count], upper[(i + 1) % upper_count]}) != 0) {
+                return -1;
+            }
+            ++i;
+        } else {
+            if(lower_count > 1 && Object3D_append_triangle(object, (Triangle3D){
+                upper[i % upper_count], lower[j], lower[(j + 1) % lower_count]}) != 0) {
+                return -1;
+            }
+            ++j;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Same as Object3D_create_sphere_lod, but appends the sphere to an
+ * existing object.
+ *
+ * @return int 0 on success, -1 if radius or tolerance is invalid or the
+ * memory could not be allocated (sphere may hold part of the sphere)
+ */
+int Object3D_append_sphere_lod(Object3D* sphere, Coordinate3D origin, double radius, double tolerance) {
+    SphereLOD lod;
+    if(SphereLOD_init(&lod, radius, tolerance) != 0) {
+        return -1;
+    }
+    STATS_BEGIN(STATS3D_SPHERE);
+    size_t ring_size = sizeof(Coordinate3D) * lod.max_segments;
+    Coordinate3D* upper = mem3d_malloc(NULL, ring_size);
+    Coordinate3D* lower = mem3d_malloc(NULL, ring_size);
+    int status = upper != NULL && lower != NULL? 0: -1;
+    if(status == 0) {
+        long upper_count = SphereLOD_ring(&lod, origin, radius, 0, upper);
+        for(long ring = 1; status == 0 && ring <= lod.bands; ++ring) {
+            long lower_count = SphereLOD_ring(&lod, origin, radius, ring, lower);
+            status = Object3D_zip_rings(sphere, upper, upper_count, lower, lower_count);
+            Coordinate3D* swap = upper;
+            upper = lower;
+            lower = swap;
+            upper_count = lower_count;
+        }
+    }
+    mem3d_free(NULL, upper, ring_size);
+    mem3d_free(NULL, lower, ring_size);
+    STATS_END(STATS3D_SPHERE);
+    return status;
+}
+
+Object3D* Object3D_create_sphere_lod(Coordinate3D origin, double radius, double tolerance) {
+    SphereLOD lod;
+    if(SphereLOD_init(&lod, radius, tolerance) != 0) {
+        return NULL;
+    }
+    Object3D* sphere = Object3D_empty_ctor();
+    if(sphere != NULL && Object3D_append_sphere_lod(sphere, origin, radius, tolerance) != 0) {
+        Object3D_dtor(sphere);
+        sphere = NULL;
     }
-    // start with one cube at origin
-    Object3D* sponge = Object3D_create_cuboid(origin, size, size, size);
+    return sphere;
+}
+
+/**
+ * @brief Appends the cubes of a fractal straight into object, in the order
+ * the fractal used to come out of merging one object per cube: the shorter
+ * list went first, so the lower levels around the centre cube end up as
+ * 5, 4, 3, 2, 1, centre cube, 0.
+ *
+ * @return int 0 on success, -1 if a triangle could not be allocated
+ */
+int Object3D_append_fractal_cubes(Object3D* object, Coordinate3D origin, double size, int levels) {
     if(levels == 1) {
-        return sponge;
+        return Object3D_append_cuboid(object, origin, size, size, size);
     }
-    // merge with the 6 lower-level fractals
-    double* mod_coords[6] = {
-        &origin.x, &origin.x,
-        &origin.y, &origin.y,
-        &origin.z, &origin.z
-    };
+    // the lower-level origins, moved off and back onto origin one after
+    // the other (so they round like they always did); the centre cube
+    // keeps the origin from before that
+    Coordinate3D center = origin;
     double mod_amount[6] = {
         -size/2, size/2,
         -size/2, size/2,
         -size/2, size/2
     };
+    Coordinate3D lower[6];
     for(int i = 0; i < 6; ++i) {
-        *(mod_coords[i]) += mod_amount[i];
-        Object3D *temp = Object3D_create_fractal(origin, size/2, levels-1);
-        Object3D_merge(sponge, &temp);        
-        *(mod_coords[i]) -= mod_amount[i];
+        double* mod_coord = axis_value(&origin, i / 2);
+        *mod_coord += mod_amount[i];
+        lower[i] = origin;
+        *mod_coord -= mod_amount[i];
+    }
+    for(int i = 5; i > 0; --i) {
+        if(Object3D_append_fractal_cubes(object, lower[i], size/2, levels-1) != 0) {
+            return -1;
+        }
+    }
+    if(Object3D_append_cuboid(object, center, size, size, size) != 0) {
+        return -1;
+    }
+    return Object3D_append_fractal_cubes(object, lower[0], size/2, levels-1);
+}
+
+/**
+ * @brief Same as Object3D_create_fractal, but appends the fractal to an
+ * existing object.
+ *
+ * @return int 0 on success, -1 if a triangle could not be allocated (object
+ * may hold part of the fractal)
+ */
+int Object3D_append_fractal(Object3D* object, Coordinate3D origin, double size, int levels) {
+    if(levels == 0) {
+        return 0; // nothing to append
+    }
+    STATS_BEGIN(STATS3D_FRACTAL);
+    int status = Object3D_append_fractal_cubes(object, origin, size, levels);
+    STATS_END(STATS3D_FRACTAL);
+    return status;
+}
+
+#include <assert.h>
+Object3D* Object3D_create_fractal(Coordinate3D origin, double size, int levels) {
+    assert(levels >= 0 && "Negative levels, no eligible object.");
+    Object3D* sponge = Object3D_empty_ctor();
+    if(sponge != NULL && Object3D_append_fractal(sponge, origin, size, levels) != 0) {
+        Object3D_dtor(sponge);
+        sponge = NULL;
     }
     return sponge;
-}
\ No newline at end of file
+}
+long Primitive3D_triangles(const Primitive3D* primitive) {
+    switch(primitive->kind) {
+        case PRIMITIVE3D_CUBOID:
+            return 12;
+        case PRIMITIVE3D_PYRAMID:
+            return 6;
+        case PRIMITIVE3D_SPHERE: {
+            // walks the same loops as Object3D_create_sphere
+            double increment = primitive->sphere.increment;
+            if(!(increment >= PRIMITIVE3D_MIN_INCREMENT && increment < 180.0)
+            || !isfinite(primitive->sphere.radius)) {
+                return -1;
+            }
+            long rows = 0, columns = 0;
+            for(double phi = increment; phi <= 180.0; phi += increment) {
+                ++rows;
+            }
+            for(double theta = 0; theta < 360.0; theta += increment) {
+                ++columns;
+            }
+            return rows * columns * 2;
+        }
+        case PRIMITIVE3D_SPHERE_LOD: {
+            SphereLOD lod;
+            if(SphereLOD_init(&lod, primitive->sphere_lod.radius, primitive->sphere_lod.tolerance) != 0) {
+                return -1;
+            }
+            return SphereLOD_triangles(&lod);
+        }
+        case PRIMITIVE3D_FRACTAL: {
+            // 12 per cube, 6^k cubes at depth k
+            int levels = primitive->fractal.levels;
+            if(levels < 0 || levels > PRIMITIVE3D_MAX_LEVELS || !isfinite(primitive->fractal.size)) {
+                return -1;
+            }
+            long cubes = 0, at_depth = 1;
+            for(int k = 0; k < levels; ++k) {
+                cubes += at_depth;
+                at_depth *= 6;
+            }
+            return cubes * 12;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Builds primitive into an existing object.
+ *
+ * @return int 0 on success, -1 if primitive is invalid or a triangle could
+ * not be allocated (object may hold part of the primitive)
+ */
+int Primitive3D_append(Object3D* object, const Primitive3D* primitive) {
+    if(Primitive3D_triangles(primitive) < 0) {
+        return -1;
+    }
+    Coordinate3D origin = primitive->origin;
+    switch(primitive->kind) {
+        case PRIMITIVE3D_CUBOID:
+            return Object3D_append_cuboid(object, origin, primitive->cuboid.width,
+                primitive->cuboid.height, primitive->cuboid.depth);
+        case PRIMITIVE3D_PYRAMID:
+            return Object3D_append_pyramid(object, origin, primitive->pyramid.width,
+                primitive->pyramid.height, primitive->pyramid.orientation);
+        case PRIMITIVE3D_SPHERE:
+            return Object3D_append_sphere(object, origin, primitive->sphere.radius,
+                primitive->sphere.increment);
+        case PRIMITIVE3D_SPHERE_LOD:
+            return Object3D_append_sphere_lod(object, origin, primitive->sphere_lod.radius,
+                primitive->sphere_lod.tolerance);
+        case PRIMITIVE3D_FRACTAL:
+            return Object3D_append_fractal(object, origin, primitive->fractal.size,
+                primitive->fractal.levels);
+    }
+    return -1;
+}
+
+Object3D* Primitive3D_create(const Primitive3D* primitive) {
+    if(Primitive3D_triangles(primitive) < 0) {
+        return NULL;
+    }
+    Object3D* object = Object3D_empty_ctor();
+    if(object != NULL && Primitive3D_append(object, primitive) != 0) {
+        Object3D_dtor(object);
+        object = NULL;
+    }
+    return object;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file 3d_platform.c
+ * @author Pegasust
+ * @brief A source file for the few things the C standard library cannot
+ * tell us about the machine
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "3d.h"
+
+#define SYSTEM3D_MAX_THREADS 64
+
+int System3D_cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0? (int)n: 1;
+}
+
+/**
+ * @brief Runs fn(arg) on up to threads threads, the calling one included,
+ * and waits for all of them. Threads that cannot be started are skipped, so
+ * fn must share out its work (e.g. through an atomic counter) instead of
+ * expecting a fixed number of threads.
+ *
+ * @param threads
+ * @param fn
+ * @param arg
+ */
+void System3D_run_threads(int threads, thrd_start_t fn, void* arg) {
+    thrd_t workers[SYSTEM3D_MAX_THREADS];
+    int started = 0;
+    for(; started < threads - 1 && started < SYSTEM3D_MAX_THREADS; ++started) {
+        if(thrd_create(&workers[started], fn, arg) != thrd_success) {
+            break;
+        }
+    }
+    fn(arg);
+    for(int i = 0; i < started; ++i) {
+        thrd_join(workers[i], NULL);
+    }
+}
+
+/**
+ * @brief Stores v as 4 little-endian bytes regardless of the host order.
+ * 
+ * @param out 
+ * @param v 
+ */
+void put_le32(unsigned char* out, uint32_t v) {
+    out[0] = v & 0xFF;
+    out[1] = (v >> 8) & 0xFF;
+    out[2] = (v >> 16) & 0xFF;
+    out[3] = (v >> 24) & 0xFF;
+}
+
+uint32_t get_le32(const unsigned char* in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8
+        | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+/**
+ * @brief Stores the IEEE-754 bits of v as 8 little-endian bytes.
+ * 
+ * @param out 
+ * @param v 
+ */
+void put_le_double(unsigned char* out, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_le32(out, (uint32_t)bits);
+    put_le32(out + 4, (uint32_t)(bits >> 32));
+}
+
+double get_le_double(const unsigned char* in) {
+    uint64_t bits = get_le32(in) | (uint64_t)get_le32(in + 4) << 32;
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
@@ -19,26 +19,243 @@
 
 #define ARRAYLIST_OBJECTS_INITIAL_CAPACITY (1024/sizeof(void*))
 
+/**
+ * Nodes allocated in one piece for an object whose triangle count is known
+ * before it is built. The first block of an object hands out its nodes
+ * front to back while it has room; all of them are freed with the block.
+ */
+typedef struct Triangle3DBlock {
+    struct Triangle3DBlock* next;
+    long size;
+    long used;
+    Triangle3DNode nodes[];
+} Triangle3DBlock;
+
+size_t Triangle3DBlock_bytes(long size) {
+    return sizeof(Triangle3DBlock) + sizeof(Triangle3DNode) * size;
+}
+
+/**
+ * @brief Allocates a block of size nodes, charged to budget as a whole.
+ *
+ * @return Triangle3DBlock* the block, or NULL if it could not be allocated
+ */
+Triangle3DBlock* Triangle3DBlock_create(MemoryBudget3D* budget, long size) {
+    Triangle3DBlock* block = mem3d_malloc(budget, Triangle3DBlock_bytes(size));
+    if(block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void Triangle3DBlock_destroy(MemoryBudget3D* budget, Triangle3DBlock* block) {
+    mem3d_free(budget, block, Triangle3DBlock_bytes(block->size));
+}
+
+/**
+ * The blocks of an object sorted by address, for telling its block nodes
+ * from its heap nodes while releasing a run of them. Only an object with
+ * both kinds of node needs to look; if the sorted array cannot be
+ * allocated, the lookup walks the block list instead.
+ */
+typedef struct Triangle3DBlockIndex {
+    const Object3D* object;
+    const Triangle3DBlock** sorted;
+    long count;
+} Triangle3DBlockIndex;
+
+// qsort order of the blocks: by the address of their nodes
+int Triangle3DBlock_compare(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)(*(const Triangle3DBlock* const*)a)->nodes;
+    uintptr_t y = (uintptr_t)(*(const Triangle3DBlock* const*)b)->nodes;
+    return x < y? -1: x > y? 1: 0;
+}
+
+int Triangle3DBlock_holds(const Triangle3DBlock* block, const Triangle3DNode* node) {
+    uintptr_t first = (uintptr_t)block->nodes;
+    return (uintptr_t)node >= first
+        && (uintptr_t)node < first + sizeof(Triangle3DNode) * block->size;
+}
+
+void Triangle3DBlockIndex_init(Triangle3DBlockIndex* index, const Object3D* object) {
+    index->object = object;
+    index->sorted = NULL;
+    index->count = 0;
+    if(object->blocks == NULL || object->heap_nodes == 0) {
+        return;
+    }
+    for(const Triangle3DBlock* block = object->blocks; block != NULL; block = block->next) {
+        ++index->count;
+    }
+    // scratch memory of a release, not the object's, so it is not charged
+    index->sorted = mem3d_malloc(NULL, sizeof(Triangle3DBlock*) * index->count);
+    if(index->sorted == NULL) {
+        return;
+    }
+    long i = 0;
+    for(const Triangle3DBlock* block = object->blocks; block != NULL; block = block->next) {
+        index->sorted[i++] = block;
+    }
+    qsort(index->sorted, index->count, sizeof(Triangle3DBlock*), Triangle3DBlock_compare);
+}
+
+void Triangle3DBlockIndex_destroy(Triangle3DBlockIndex* index) {
+    mem3d_free(NULL, index->sorted, sizeof(Triangle3DBlock*) * index->count);
+    index->sorted = NULL;
+}
+
+/**
+ * @brief Whether node, one of the indexed object's nodes, lives in a block.
+ */
+int Triangle3DBlockIndex_holds(const Triangle3DBlockIndex* index, const Triangle3DNode* node) {
+    const Object3D* object = index->object;
+    if(object->blocks == NULL) {
+        return 0;
+    }
+    if(object->heap_nodes == 0) {
+        return 1;
+    }
+    if(index->sorted == NULL) {
+        for(const Triangle3DBlock* block = object->blocks; block != NULL; block = block->next) {
+            if(Triangle3DBlock_holds(block, node)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    // the last block starting at or before node
+    long low = 0, high = index->count;
+    while(high - low > 1) {
+        long middle = low + (high - low) / 2;
+        if((uintptr_t)index->sorted[middle]->nodes <= (uintptr_t)node) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return Triangle3DBlock_holds(index->sorted[low], node);
+}
+
+/**
+ * @brief Allocates a node for object, from its first block if that has room.
+ *
+ * @return Triangle3DNode* the node, or NULL if it could not be allocated
+ */
+Triangle3DNode* Object3D_new_node(Object3D* object) {
+    Triangle3DBlock* block = object->blocks;
+    if(block != NULL && block->used < block->size) {
+        return &block->nodes[block->used++];
+    }
+    Triangle3DNode* node = mem3d_malloc(object->budget, sizeof(Triangle3DNode));
+    if(node != NULL) {
+        ++object->heap_nodes;
+    }
+    return node;
+}
+
+/**
+ * @brief Frees a node of object that was unlinked (a no-op for block nodes).
+ * index must have been made for object.
+ */
+void Object3D_release_node(Object3D* object, const Triangle3DBlockIndex* index, Triangle3DNode* node) {
+    if(!Triangle3DBlockIndex_holds(index, node)) {
+        mem3d_free(object->budget, node, sizeof(Triangle3DNode));
+        --object->heap_nodes;
+    }
+}
+
+/**
+ * @brief Hands the nodes of object that its list was spliced into owner's
+ * over to owner: its blocks (put in front of owner's, so a block with room
+ * left keeps handing out nodes) and the count of its heap nodes.
+ */
+void Object3D_adopt_blocks(Object3D* owner, Object3D* object) {
+    owner->heap_nodes += object->heap_nodes;
+    object->heap_nodes = 0;
+    if(object->blocks == NULL) {
+        return;
+    }
+    Triangle3DBlock* last = object->blocks;
+    while(last->next != NULL) {
+        last = last->next;
+    }
+    last->next = owner->blocks;
+    owner->blocks = object->blocks;
+    object->blocks = NULL;
+}
+
+void Object3D_free_blocks(Object3D* object) {
+    Triangle3DBlock* next;
+    for(Triangle3DBlock* block = object->blocks; block != NULL; block = next) {
+        next = block->next;
+        Triangle3DBlock_destroy(object->budget, block);
+    }
+    object->blocks = NULL;
+}
+
+/**
+ * @brief The bytes of object's triangle storage (nodes and blocks) that are
+ * charged to its budget.
+ */
+size_t Object3D_node_bytes(const Object3D* object) {
+    size_t bytes = sizeof(Triangle3DNode) * object->heap_nodes;
+    for(const Triangle3DBlock* block = object->blocks; block != NULL; block = block->next) {
+        bytes += Triangle3DBlock_bytes(block->size);
+    }
+    return bytes;
+}
+
+/**
+ * @brief Creates an object without triangles, charged to the budget bound
+ * to this thread.
+ * 
+ * @return Object3D* the object, or NULL if it could not be allocated
+ */
 Object3D* Object3D_empty_ctor() {
-    Object3D* retval = malloc(sizeof(Object3D));
+    MemoryBudget3D* budget = MemoryBudget3D_bound();
+    Object3D* retval = mem3d_malloc(budget, sizeof(Object3D));
+    if(retval == NULL) {
+        return NULL;
+    }
+    retval->budget = budget;
     retval->count = 0;
     retval->root = NULL;
+    retval->tail = NULL;
+    retval->quantized = NULL;
+    retval->grid = (QuantizationGrid3D){{0.0, 0.0, 0.0}, 0.0};
+    retval->dirty = 1;
+    retval->stl_text = (EncodedFacets3D){NULL, 0};
+    retval->stl_binary = (EncodedFacets3D){NULL, 0};
+    retval->blocks = NULL;
+    retval->heap_nodes = 0;
 
     return retval;
 }
 
 /**
- * @brief Pushes a new triangle node in front of `obj->objects`
+ * @brief Pushes a new triangle node in front of `obj->objects`. A quantized
+ * obj is turned back into its node list first.
  * 
  * @param obj 
  * @param node 
- * @return Object3D* 
+ * @return Object3D* obj, or NULL if it could not be dequantized (node is
+ * not linked)
  */
 Object3D* Object3D_push_triangle_node(Object3D* obj, Triangle3DNode* node) {
     if(node == NULL) {return obj;}
+    if(Object3D_dequantize(obj) == NULL) {
+        return NULL;
+    }
     ++obj->count;
+    obj->dirty = 1;
     node->next = obj->root;
     obj->root = node;
+    if(obj->tail == NULL) {
+        obj->tail = node;
+    }
     return obj;
 }
 /**
@@ -48,82 +265,418 @@ Object3D* Object3D_push_triangle_node(Object3D* obj, Triangle3DNode* node) {
  * @param a 
  * @param b 
  * @param c 
- * @return Object3D* obj itself. If malloc for root failed, returns NULL.
+ * @return Object3D* obj itself. If the node could not be allocated, returns
+ * NULL and obj is left unchanged.
  */
 Object3D* Object3D_emplace_triangle(Object3D* obj, 
     Coordinate3D a, Coordinate3D b, Coordinate3D c) 
 {
-    Triangle3DNode* new_node = malloc(sizeof(Triangle3DNode));
+    // before taking the node, so it is not counted in the dequantized list
+    if(Object3D_dequantize(obj) == NULL) {
+        return NULL;
+    }
+    Triangle3DNode* new_node = Object3D_new_node(obj);
     if(new_node == NULL) {
-        // TODO: handle this bad case
+        return NULL;
     }
+    STATS_TRIANGLES(1);
     new_node->triangle.a = a;
     new_node->triangle.b = b;
     new_node->triangle.c = c;
     return Object3D_push_triangle_node(obj, new_node);
 }
 
-void Object3D_dtor(Object3D* obj) {
+/**
+ * @brief Frees the cached encoded facets of object.
+ * 
+ * @param object 
+ */
+void Object3D_drop_encoded(Object3D* object) {
+    mem3d_free(object->budget, object->stl_text.data, object->stl_text.len);
+    mem3d_free(object->budget, object->stl_binary.data, object->stl_binary.len);
+    object->stl_text = (EncodedFacets3D){NULL, 0};
+    object->stl_binary = (EncodedFacets3D){NULL, 0};
+}
+
+void Object3D_free_nodes(Object3D* object, Triangle3DNode* root) {
+    Triangle3DBlockIndex index;
+    Triangle3DBlockIndex_init(&index, object);
     Triangle3DNode *next;
-    for(Triangle3DNode* iter = obj->root; iter != NULL; iter = next) {
+    for(Triangle3DNode* iter = root; iter != NULL; iter = next) {
         next = iter->next;
-        free(iter);
+        Object3D_release_node(object, &index, iter);
     }
-    free(obj);
+    Triangle3DBlockIndex_destroy(&index);
+}
+
+/**
+ * @brief Frees the nodes of object's list that are not in a block; the
+ * others go with the blocks, so an object built in blocks skips the walk.
+ */
+void Object3D_free_heap_nodes(Object3D* object) {
+    if(object->heap_nodes > 0) {
+        Object3D_free_nodes(object, object->root);
+    }
+}
+
+size_t Object3D_quantized_size(const Object3D* obj) {
+    return sizeof(QTriangle3D) * (obj->count > 0? obj->count: 1);
+}
+
+void Object3D_dtor(Object3D* obj) {
+    if(obj == NULL) {
+        return;
+    }
+    Object3D_free_heap_nodes(obj);
+    Object3D_free_blocks(obj);
+    if(obj->quantized != NULL) {
+        mem3d_free(obj->budget, obj->quantized, Object3D_quantized_size(obj));
+    }
+    Object3D_drop_encoded(obj);
+    mem3d_free(obj->budget, obj, sizeof(Object3D));
+}
+
+void Object3D_mark_dirty(Object3D* object) {
+    object->dirty = 1;
 }
 
 Scene3D* Scene3D_create() {
     const int objects_sz = sizeof(Object3D*) * ARRAYLIST_OBJECTS_INITIAL_CAPACITY;
-    Scene3D* retval = malloc(sizeof(Scene3D));
+    MemoryBudget3D* budget = MemoryBudget3D_bound();
+    Scene3D* retval = mem3d_malloc(budget, sizeof(Scene3D));
+    if(retval == NULL) {
+        return NULL;
+    }
+    retval->objects = mem3d_malloc(budget, objects_sz);
+    if(retval->objects == NULL) {
+        mem3d_free(budget, retval, sizeof(Scene3D));
+        return NULL;
+    }
+    retval->budget = budget;
+    retval->owns_budget = 0;
     retval->count = 0;
     retval->size = ARRAYLIST_OBJECTS_INITIAL_CAPACITY;
-    retval->objects = malloc(objects_sz);
+    retval->quantize = 0;
+    retval->grid = (QuantizationGrid3D){{0.0, 0.0, 0.0}, 0.0};
+    retval->encoding_cache = 0;
+    Stats3D_snapshot(&retval->stats_baseline);
     return retval;
 }
 
+Scene3D* Scene3D_create_bounded(size_t max_bytes) {
+    MemoryBudget3D* budget = MemoryBudget3D_create(max_bytes);
+    if(budget == NULL) {
+        return NULL;
+    }
+    MemoryBudget3D* previous = MemoryBudget3D_bind(budget);
+    Scene3D* scene = Scene3D_create();
+    if(scene == NULL) {
+        MemoryBudget3D_bind(previous);
+        MemoryBudget3D_destroy(budget);
+        return NULL;
+    }
+    scene->owns_budget = 1;
+    return scene;
+}
+
 void Scene3D_destroy(Scene3D* scene) {
     for(long i = 0; i < scene->count; ++i) {
         // destroy each Object3D
         Object3D_dtor(scene->objects[i]);
     }
-    free(scene->objects);
-    free(scene);
+    MemoryBudget3D* budget = scene->budget;
+    int owns_budget = scene->owns_budget;
+    mem3d_free(budget, scene->objects, sizeof(Object3D*) * scene->size);
+    mem3d_free(budget, scene, sizeof(Scene3D));
+    if(owns_budget) {
+        if(MemoryBudget3D_bound() == budget) {
+            MemoryBudget3D_bind(NULL);
+        }
+        MemoryBudget3D_destroy(budget);
+    }
 }
 
-void Scene3D_append(Scene3D* scene, Object3D* object) {
-    ++scene->count;
-    if(scene->count == scene->size) {
+/**
+ * @brief Grows the object array so that the next extra appends cannot fail.
+ *
+ * @return int 0 on success, -1 if the array could not grow
+ */
+int Scene3D_reserve(Scene3D* scene, long extra) {
+    // Scene3D_append grows once count + 1 reaches size
+    long needed = scene->count + extra + 1;
+    if(needed <= scene->size) {
+        return 0;
+    }
+    long size = scene->size;
+    while(size < needed) {
+        size *= 2;
+    }
+    Object3D** grown = mem3d_realloc(scene->budget, scene->objects,
+        sizeof(Object3D*) * scene->size, sizeof(Object3D*) * size);
+    if(grown == NULL) {
+        return -1;
+    }
+    scene->objects = grown;
+    scene->size = size;
+    return 0;
+}
+
+int Object3D_quantize_status(Object3D* object, QuantizationGrid3D grid);
+
+int Scene3D_append(Scene3D* scene, Object3D* object) {
+    if(scene->count + 1 == scene->size) {
         // need to regrow by doubling.
-        // realloc
-        Object3D** new = realloc(scene->objects, sizeof(Object3D*) * scene->size * 2);
+        Object3D** new = mem3d_realloc(scene->budget, scene->objects,
+            sizeof(Object3D*) * scene->size, sizeof(Object3D*) * scene->size * 2);
         if(new == NULL) {
-            // TODO: Handle bad case NULL realloc
+            return -1; // the old array is still intact
         }
         scene->size *= 2;
         scene->objects = new; // no need for free because realloc takes care of it for us
     }
+    // an object that does not fit on the grid simply stays in doubles
+    if(scene->quantize && Object3D_quantize_status(object, scene->grid) < 0) {
+        return -1;
+    }
     // no more regrow concerns, basic adding.
-    scene->objects[scene->count-1] = object;
+    scene->objects[scene->count++] = object;
+    return 0;
+}
+
+/**
+ * @brief Snaps a coordinate onto grid.
+ * 
+ * @param out 
+ * @param c 
+ * @param grid 
+ * @return int 1 on success, 0 if c is out of the int32 range of grid
+ */
+int Coordinate3D_quantize(QCoordinate3D* out, Coordinate3D c, const QuantizationGrid3D* grid) {
+    double v[3] = {
+        (c.x - grid->origin.x) / grid->scale,
+        (c.y - grid->origin.y) / grid->scale,
+        (c.z - grid->origin.z) / grid->scale
+    };
+    int32_t q[3];
+    for(int i = 0; i < 3; ++i) {
+        // rounded before the check, INT32_MAX + 0.4 would round out of range;
+        // negated comparison so that NaN is rejected as well
+        double rounded = round(v[i]);
+        if(!(rounded >= INT32_MIN && rounded <= INT32_MAX)) {
+            return 0;
+        }
+        q[i] = (int32_t)rounded;
+    }
+    *out = (QCoordinate3D){q[0], q[1], q[2]};
+    return 1;
+}
+
+Coordinate3D QCoordinate3D_dequantize(QCoordinate3D q, const QuantizationGrid3D* grid) {
+    return (Coordinate3D){
+        grid->origin.x + q.x * grid->scale,
+        grid->origin.y + q.y * grid->scale,
+        grid->origin.z + q.z * grid->scale
+    };
+}
+
+int QCoordinate3D_equal(QCoordinate3D a, QCoordinate3D b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+/**
+ * @brief Object3D_quantize, telling why it failed.
+ *
+ * @return int 0 on success, 1 if a coordinate does not fit on the grid,
+ * -1 if the packed array could not be allocated (or the grid is invalid)
+ */
+int Object3D_quantize_status(Object3D* object, QuantizationGrid3D grid) {
+    if(!(grid.scale > 0.0)) {
+        return -1;
+    }
+    QTriangle3D* packed = mem3d_malloc(object->budget, Object3D_quantized_size(object));
+    if(packed == NULL) {
+        return -1;
+    }
+    long i = 0;
+    if(object->quantized != NULL) {
+        // re-grid: go through the old grid's doubles
+        for(; i < object->count; ++i) {
+            QTriangle3D* q = &object->quantized[i];
+            if(!Coordinate3D_quantize(&packed[i].a, QCoordinate3D_dequantize(q->a, &object->grid), &grid)
+            || !Coordinate3D_quantize(&packed[i].b, QCoordinate3D_dequantize(q->b, &object->grid), &grid)
+            || !Coordinate3D_quantize(&packed[i].c, QCoordinate3D_dequantize(q->c, &object->grid), &grid)) {
+                mem3d_free(object->budget, packed, Object3D_quantized_size(object));
+                return 1;
+            }
+        }
+        mem3d_free(object->budget, object->quantized, Object3D_quantized_size(object));
+    } else {
+        for(Triangle3DNode* iter = object->root; iter != NULL; iter = iter->next, ++i) {
+            if(!Coordinate3D_quantize(&packed[i].a, iter->triangle.a, &grid)
+            || !Coordinate3D_quantize(&packed[i].b, iter->triangle.b, &grid)
+            || !Coordinate3D_quantize(&packed[i].c, iter->triangle.c, &grid)) {
+                mem3d_free(object->budget, packed, Object3D_quantized_size(object));
+                return 1;
+            }
+        }
+        Object3D_free_heap_nodes(object);
+        Object3D_free_blocks(object);
+        object->root = NULL;
+        object->tail = NULL;
+    }
+    object->quantized = packed;
+    object->grid = grid;
+    object->dirty = 1;
+    return 0;
+}
+
+Object3D* Object3D_quantize(Object3D* object, QuantizationGrid3D grid) {
+    return Object3D_quantize_status(object, grid) == 0? object: NULL;
+}
+
+Object3D* Object3D_dequantize(Object3D* object) {
+    if(object->quantized == NULL) {
+        return object;
+    }
+    // build the list back to front so the triangle order is kept
+    Triangle3DNode* root = NULL;
+    Triangle3DNode* tail = NULL;
+    for(long i = object->count - 1; i >= 0; --i) {
+        Triangle3DNode* node = Object3D_new_node(object);
+        if(node == NULL) {
+            Object3D_free_nodes(object, root);
+            return NULL;
+        }
+        QTriangle3D* q = &object->quantized[i];
+        node->triangle.a = QCoordinate3D_dequantize(q->a, &object->grid);
+        node->triangle.b = QCoordinate3D_dequantize(q->b, &object->grid);
+        node->triangle.c = QCoordinate3D_dequantize(q->c, &object->grid);
+        node->next = root;
+        root = node;
+        if(tail == NULL) {
+            tail = node;
+        }
+    }
+    mem3d_free(object->budget, object->quantized, Object3D_quantized_size(object));
+    object->quantized = NULL;
+    object->root = root;
+    object->tail = tail;
+    return object;
+}
+
+int Scene3D_set_quantization(Scene3D* scene, Coordinate3D origin, double scale) {
+    if(!(scale > 0.0) || isinf(scale)) {
+        return -1;
+    }
+    scene->quantize = 1;
+    scene->grid = (QuantizationGrid3D){origin, scale};
+    for(long i = 0; i < scene->count; ++i) {
+        if(Object3D_quantize_status(scene->objects[i], scene->grid) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void Scene3D_set_encoding_cache(Scene3D* scene, int enabled) {
+    scene->encoding_cache = enabled;
+    if(!enabled) {
+        for(long i = 0; i < scene->count; ++i) {
+            Object3D_drop_encoded(scene->objects[i]);
+        }
+    }
+}
+
+Object3D* Object3D_translate(Object3D* object, Coordinate3D offset) {
+    int quantized = object->quantized != NULL;
+    if(Object3D_dequantize(object) == NULL) {
+        return NULL;
+    }
+    for(Triangle3DNode* iter = object->root; iter != NULL; iter = iter->next) {
+        Coordinate3D* corners[3] = {&iter->triangle.a, &iter->triangle.b, &iter->triangle.c};
+        for(int i = 0; i < 3; ++i) {
+            corners[i]->x += offset.x;
+            corners[i]->y += offset.y;
+            corners[i]->z += offset.z;
+        }
+    }
+    if(quantized) {
+        // moved off the grid's range: stays in doubles, like Scene3D_append
+        Object3D_quantize(object, object->grid);
+    }
+    object->dirty = 1;
+    return object;
+}
+
+/**
+ * Walks the triangles of an object regardless of how they are stored.
+ * Quantized triangles are dequantized on the fly.
+ */
+typedef struct Triangle3DIterator {
+    const Object3D* object;
+    const Triangle3DNode* node;
+    long index;
+} Triangle3DIterator;
+
+void Triangle3DIterator_init(Triangle3DIterator* it, const Object3D* object) {
+    it->object = object;
+    it->node = object->root;
+    it->index = 0;
+}
+
+/**
+ * @brief Fetches the next triangle of the iterated object into out
+ * 
+ * @param it 
+ * @param out 
+ * @return int 1 if out was filled, 0 when there are no triangles left
+ */
+int Triangle3DIterator_next(Triangle3DIterator* it, Triangle3D* out) {
+    const Object3D* object = it->object;
+    if(object->quantized != NULL) {
+        if(it->index >= object->count) {
+            return 0;
+        }
+        const QTriangle3D* q = &object->quantized[it->index++];
+        out->a = QCoordinate3D_dequantize(q->a, &object->grid);
+        out->b = QCoordinate3D_dequantize(q->b, &object->grid);
+        out->c = QCoordinate3D_dequantize(q->c, &object->grid);
+        return 1;
+    }
+    if(it->node == NULL) {
+        return 0;
+    }
+    *out = it->node->triangle;
+    it->node = it->node->next;
+    ++it->index;
+    return 1;
 }
 
 
 /**
- * A Helper function to append a Triangle3DNode to an Object3D.
+ * A Helper function to append a Triangle3DNode to an Object3D. A quantized
+ * object is turned back into its node list first.
  *   Parameters:
  *     object - the object to append to
  *     node   - the node to append
+ *   Return:
+ *     0 on success, -1 if the object could not be dequantized (the node is
+ *     not linked)
  */
-void Object3D_append_object_node(Object3D* object, Triangle3DNode* node) {
+int Object3D_append_object_node(Object3D* object, Triangle3DNode* node) {
+  if (Object3D_dequantize(object) == NULL) {
+    return -1;
+  }
   object->count += 1;
+  object->dirty = 1;
+  node->next = NULL;
   if (object->root == NULL) {
     object->root = node;
-    return;
-  }
-  Triangle3DNode* temp = object->root;
-  while (temp->next != NULL) {
-     temp = temp->next;
+  } else {
+    object->tail->next = node;
   }
-  temp->next = node;
+  object->tail = node;
+  return 0;
 }
 
 /**
@@ -131,11 +684,21 @@ void Object3D_append_object_node(Object3D* object, Triangle3DNode* node) {
  *   Parameters:
  *     object   - the object to append to
  *     triangle - the triangle to append
+ *   Return:
+ *     0 on success, -1 if the node could not be allocated
  */
-void Object3D_append_triangle(Object3D* object, Triangle3D triangle) {
-  Triangle3DNode* node = calloc(1, sizeof(Triangle3DNode));
+int Object3D_append_triangle(Object3D* object, Triangle3D triangle) {
+  // before taking the node, so it is not counted in the dequantized list
+  if (Object3D_dequantize(object) == NULL) {
+    return -1;
+  }
+  Triangle3DNode* node = Object3D_new_node(object);
+  if (node == NULL) {
+    return -1;
+  }
+  STATS_TRIANGLES(1);
   node->triangle = triangle;
-  Object3D_append_object_node(object, node);
+  return Object3D_append_object_node(object, node);
 }
 
 /**
@@ -210,8 +773,9 @@ void Coordinate3D_sort(Coordinate3D* array, int size) {
 }
 #include <stdio.h>
 
-void Object3D_append_quadrilateral(Object3D* o, 
+int Object3D_append_quadrilateral(Object3D* o, 
     Coordinate3D a, Coordinate3D b, Coordinate3D c, Coordinate3D d) {
+  STATS_BEGIN(STATS3D_QUADRILATERAL);
 
   Coordinate3D starting, closest1, closest2, farthest;
   Coordinate3D co[] = {a, b, c, d};
@@ -237,8 +801,9 @@ void Object3D_append_quadrilateral(Object3D* o,
         } else if (i == 2) {
           single = (Triangle3D) {a, b, d};
         }
-        Object3D_append_triangle(o, single);
-        return;
+        int status = Object3D_append_triangle(o, single);
+        STATS_END(STATS3D_QUADRILATERAL);
+        return status;
       }
       if (distances[ci] > max_distance) {
         max_distance = distances[ci];
@@ -260,11 +825,16 @@ void Object3D_append_quadrilateral(Object3D* o,
   // Put a triangle between starting point, and two closest to it
   Coordinate3D_get_closest_two(starting, tcoords, &closest1, &closest2, &farthest);
   Triangle3D t1 = (Triangle3D) {starting, closest1, closest2};
-  Object3D_append_triangle(o, t1); 
+  if (Object3D_append_triangle(o, t1) != 0) {
+    STATS_END(STATS3D_QUADRILATERAL);
+    return -1;
+  }
 
   // For the remaining unused point, find two closest, and build second triangle
   tcoords[0] = closest1; tcoords[1] = closest2; tcoords[2] = starting;
   Coordinate3D_get_closest_two(farthest, tcoords, &closest1, &closest2, &starting);
   Triangle3D t2 = (Triangle3D) {farthest, closest1, closest2};
-  Object3D_append_triangle(o, t2); 
+  int status = Object3D_append_triangle(o, t2);
+  STATS_END(STATS3D_QUADRILATERAL);
+  return status;
 }
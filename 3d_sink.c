@@ -0,0 +1,378 @@
+/**
+ * @file 3d_sink.c
+ * @author Pegasust
+ * @brief Byte sinks the writers stream into: plain files and gzip files
+ * compressed by a pool of threads in independent deflate blocks
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <zlib.h>
+#include "3d.h"
+
+typedef struct FileSink3D {
+    OutputSink3D base;
+    FILE* f;
+    int owns_file;
+    MemoryBudget3D* budget;
+} FileSink3D;
+
+int FileSink3D_write(OutputSink3D* sink, const void* data, size_t len) {
+    FileSink3D* s = (FileSink3D*)sink;
+    size_t written = fwrite(data, 1, len, s->f);
+    STATS_WRITTEN(written);
+    return written == len? 0: -1;
+}
+
+int FileSink3D_flush(OutputSink3D* sink) {
+    FileSink3D* s = (FileSink3D*)sink;
+    return fflush(s->f) == 0? 0: -1;
+}
+
+int FileSink3D_close(OutputSink3D* sink) {
+    FileSink3D* s = (FileSink3D*)sink;
+    int status = s->owns_file? fclose(s->f): fflush(s->f);
+    mem3d_free(s->budget, s, sizeof(FileSink3D));
+    return status == 0? 0: -1;
+}
+
+OutputSink3D* FileSink3D_create(FILE* f, int owns_file) {
+    MemoryBudget3D* budget = MemoryBudget3D_bound();
+    FileSink3D* s = mem3d_malloc(budget, sizeof(FileSink3D));
+    if(s == NULL) {
+        return NULL;
+    }
+    s->budget = budget;
+    s->base.write = FileSink3D_write;
+    s->base.flush = FileSink3D_flush;
+    s->base.close = FileSink3D_close;
+    s->f = f;
+    s->owns_file = owns_file;
+    return &s->base;
+}
+
+OutputSink3D* OutputSink3D_open_file(const char* file_name, const char* mode) {
+    FILE* f = fopen(file_name, mode);
+    if(f == NULL) {
+        return NULL;
+    }
+    OutputSink3D* sink = FileSink3D_create(f, 1);
+    if(sink == NULL) {
+        fclose(f);
+    }
+    return sink;
+}
+
+OutputSink3D* OutputSink3D_from_file(FILE* f) {
+    return FileSink3D_create(f, 0);
+}
+
+// Same block size as pigz: large enough that restarting the dictionary at
+// every block costs well under 1% of the ratio.
+#define GZIP_BLOCK_SIZE (128 * 1024)
+
+enum GzipBlockState {
+    GZIP_BLOCK_FREE,     // owned by the producer, being filled
+    GZIP_BLOCK_READY,    // waiting for a worker
+    GZIP_BLOCK_BUSY,     // being compressed
+    GZIP_BLOCK_DONE      // compressed, waiting to be written in order
+};
+
+typedef struct GzipBlock {
+    enum GzipBlockState state;
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+    uLong crc;
+    int error;
+} GzipBlock;
+
+/**
+ * The blocks form a ring of 2 per worker. The producer fills
+ * blocks[next_fill], workers claim READY blocks from next_compress onwards,
+ * and the producer writes DONE blocks to the file from next_output onwards
+ * so that the deflate stream stays in order.
+ */
+typedef struct GzipSink3D {
+    OutputSink3D base;
+    FILE* f;
+    MemoryBudget3D* budget;
+    int level;
+    int thread_count;
+    thrd_t* threads;
+    mtx_t lock;
+    cnd_t ready;
+    cnd_t done;
+    int block_count;
+    GzipBlock* blocks;
+    size_t out_size;
+    int next_fill;
+    int next_compress;
+    int next_output;
+    int closing;
+    int error;
+    uLong crc;
+    uLong total_len;
+} GzipSink3D;
+
+/**
+ * @brief Frees the sink and its blocks (threads holds block_count / 2 slots).
+ */
+void GzipSink3D_free(GzipSink3D* s) {
+    for(int i = 0; s->blocks != NULL && i < s->block_count; ++i) {
+        mem3d_free(s->budget, s->blocks[i].in, GZIP_BLOCK_SIZE);
+        mem3d_free(s->budget, s->blocks[i].out, s->out_size);
+    }
+    mem3d_free(s->budget, s->blocks, s->block_count * sizeof(GzipBlock));
+    mem3d_free(s->budget, s->threads, s->block_count / 2 * sizeof(thrd_t));
+    mem3d_free(s->budget, s, sizeof(GzipSink3D));
+}
+
+int GzipSink3D_worker(void* arg) {
+    GzipSink3D* s = arg;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // raw deflate: the gzip framing is written by the sink itself
+    int init = deflateInit2(&strm, s->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    mtx_lock(&s->lock);
+    for(;;) {
+        while(s->blocks[s->next_compress].state != GZIP_BLOCK_READY && !s->closing) {
+            cnd_wait(&s->ready, &s->lock);
+        }
+        GzipBlock* block = &s->blocks[s->next_compress];
+        if(block->state != GZIP_BLOCK_READY) {
+            break; // closing and nothing left
+        }
+        block->state = GZIP_BLOCK_BUSY;
+        s->next_compress = (s->next_compress + 1) % s->block_count;
+        mtx_unlock(&s->lock);
+
+        // every block is an independent deflate stream ended by a sync
+        // flush, so blocks can be compressed in any order and concatenated
+        int failed = init != Z_OK || deflateReset(&strm) != Z_OK;
+        if(!failed) {
+            strm.next_in = block->in;
+            strm.avail_in = block->in_len;
+            strm.next_out = block->out;
+            strm.avail_out = deflateBound(&strm, block->in_len) + 16;
+            failed = deflate(&strm, Z_SYNC_FLUSH) != Z_OK || strm.avail_in != 0;
+            block->out_len = strm.next_out - block->out;
+        }
+        block->crc = crc32(0L, block->in, block->in_len);
+
+        mtx_lock(&s->lock);
+        block->error = failed;
+        block->state = GZIP_BLOCK_DONE;
+        cnd_broadcast(&s->done);
+    }
+    mtx_unlock(&s->lock);
+    if(init == Z_OK) {
+        deflateEnd(&strm);
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the block at next_output to the file once it is compressed.
+ * Must be called with the lock held.
+ *
+ * @param s
+ */
+void GzipSink3D_output_next(GzipSink3D* s) {
+    GzipBlock* block = &s->blocks[s->next_output];
+    while(block->state != GZIP_BLOCK_DONE) {
+        cnd_wait(&s->done, &s->lock);
+    }
+    mtx_unlock(&s->lock);
+    int failed = block->error
+        || fwrite(block->out, 1, block->out_len, s->f) != block->out_len;
+    STATS_WRITTEN(failed? 0: block->out_len);
+    mtx_lock(&s->lock);
+    if(failed) {
+        s->error = 1;
+    }
+    s->crc = crc32_combine(s->crc, block->crc, block->in_len);
+    s->total_len += block->in_len;
+    block->in_len = 0;
+    block->state = GZIP_BLOCK_FREE;
+    s->next_output = (s->next_output + 1) % s->block_count;
+}
+
+/**
+ * @brief Hands the block being filled to the workers and makes sure the
+ * next one in the ring is free, writing out older blocks as needed.
+ *
+ * @param s
+ */
+void GzipSink3D_submit(GzipSink3D* s) {
+    mtx_lock(&s->lock);
+    s->blocks[s->next_fill].state = GZIP_BLOCK_READY;
+    cnd_signal(&s->ready);
+    s->next_fill = (s->next_fill + 1) % s->block_count;
+    if(s->next_fill == s->next_output) {
+        GzipSink3D_output_next(s);
+    }
+    mtx_unlock(&s->lock);
+}
+
+int GzipSink3D_write(OutputSink3D* sink, const void* data, size_t len) {
+    GzipSink3D* s = (GzipSink3D*)sink;
+    const unsigned char* bytes = data;
+    while(len > 0) {
+        GzipBlock* block = &s->blocks[s->next_fill];
+        size_t n = GZIP_BLOCK_SIZE - block->in_len;
+        n = len < n? len: n;
+        memcpy(block->in + block->in_len, bytes, n);
+        block->in_len += n;
+        bytes += n;
+        len -= n;
+        if(block->in_len == GZIP_BLOCK_SIZE) {
+            GzipSink3D_submit(s);
+        }
+    }
+    return s->error? -1: 0;
+}
+
+/**
+ * @brief Compresses whatever is buffered and writes every pending block.
+ *
+ * @param s
+ */
+void GzipSink3D_drain(GzipSink3D* s) {
+    if(s->blocks[s->next_fill].in_len > 0) {
+        GzipSink3D_submit(s);
+    }
+    mtx_lock(&s->lock);
+    while(s->next_output != s->next_fill) {
+        GzipSink3D_output_next(s);
+    }
+    mtx_unlock(&s->lock);
+}
+
+int GzipSink3D_flush(OutputSink3D* sink) {
+    GzipSink3D* s = (GzipSink3D*)sink;
+    GzipSink3D_drain(s);
+    if(fflush(s->f) != 0) {
+        s->error = 1;
+    }
+    return s->error? -1: 0;
+}
+
+int GzipSink3D_close(OutputSink3D* sink) {
+    GzipSink3D* s = (GzipSink3D*)sink;
+    GzipSink3D_drain(s);
+
+    mtx_lock(&s->lock);
+    s->closing = 1;
+    cnd_broadcast(&s->ready);
+    mtx_unlock(&s->lock);
+    for(int i = 0; i < s->thread_count; ++i) {
+        thrd_join(s->threads[i], NULL);
+    }
+
+    // an empty final block (BFINAL set) ends the deflate stream, followed
+    // by the gzip trailer: CRC-32 and the input length modulo 2^32
+    unsigned char trailer[10] = {0x03, 0x00};
+    put_le32(trailer + 2, (uint32_t)s->crc);
+    put_le32(trailer + 6, (uint32_t)s->total_len);
+    if(fwrite(trailer, 1, sizeof(trailer), s->f) != sizeof(trailer)) {
+        s->error = 1;
+    }
+    STATS_WRITTEN(sizeof(trailer));
+    if(fclose(s->f) != 0) {
+        s->error = 1;
+    }
+    int status = s->error? -1: 0;
+
+    cnd_destroy(&s->done);
+    cnd_destroy(&s->ready);
+    mtx_destroy(&s->lock);
+    GzipSink3D_free(s);
+    return status;
+}
+
+OutputSink3D* OutputSink3D_open_gzip(const char* file_name, int level, int threads) {
+    if(threads <= 0) {
+        threads = System3D_cpu_count();
+    }
+    MemoryBudget3D* budget = MemoryBudget3D_bound();
+    GzipSink3D* s = mem3d_calloc(budget, 1, sizeof(GzipSink3D));
+    if(s == NULL) {
+        return NULL;
+    }
+    s->budget = budget;
+    s->base.write = GzipSink3D_write;
+    s->base.flush = GzipSink3D_flush;
+    s->base.close = GzipSink3D_close;
+    s->level = level;
+    s->crc = crc32(0L, Z_NULL, 0);
+    s->block_count = threads * 2;
+    s->blocks = mem3d_calloc(s->budget, s->block_count, sizeof(GzipBlock));
+    s->threads = mem3d_calloc(s->budget, threads, sizeof(thrd_t));
+    if(s->blocks == NULL || s->threads == NULL) {
+        goto fail_blocks;
+    }
+    // a sync flushed block never grows past the deflate bound of its input
+    // plus the empty stored block that ends it
+    z_stream probe;
+    memset(&probe, 0, sizeof(probe));
+    if(deflateInit2(&probe, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        goto fail_blocks;
+    }
+    s->out_size = deflateBound(&probe, GZIP_BLOCK_SIZE) + 16;
+    deflateEnd(&probe);
+    for(int i = 0; i < s->block_count; ++i) {
+        s->blocks[i].in = mem3d_malloc(s->budget, GZIP_BLOCK_SIZE);
+        s->blocks[i].out = mem3d_malloc(s->budget, s->out_size);
+        if(s->blocks[i].in == NULL || s->blocks[i].out == NULL) {
+            goto fail_blocks;
+        }
+    }
+    if(mtx_init(&s->lock, mtx_plain) != thrd_success) {
+        goto fail_blocks;
+    }
+    if(cnd_init(&s->ready) != thrd_success) {
+        goto fail_lock;
+    }
+    if(cnd_init(&s->done) != thrd_success) {
+        goto fail_ready;
+    }
+    s->f = fopen(file_name, "wb");
+    if(s->f == NULL) {
+        goto fail_done;
+    }
+    // gzip member header: magic, deflate, no flags, no mtime, unknown OS
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255
+    };
+    if(fwrite(header, 1, sizeof(header), s->f) != sizeof(header)) {
+        fclose(s->f);
+        goto fail_done;
+    }
+    STATS_WRITTEN(sizeof(header));
+    for(; s->thread_count < threads; ++s->thread_count) {
+        if(thrd_create(&s->threads[s->thread_count], GzipSink3D_worker, s) != thrd_success) {
+            break;
+        }
+    }
+    if(s->thread_count == 0) {
+        fclose(s->f);
+        goto fail_done;
+    }
+    return &s->base;
+
+fail_done:
+    cnd_destroy(&s->done);
+fail_ready:
+    cnd_destroy(&s->ready);
+fail_lock:
+    mtx_destroy(&s->lock);
+fail_blocks:
+    GzipSink3D_free(s);
+    return NULL;
+}
@@ -0,0 +1,523 @@
+/**
+ * @file 3d_stats.c
+ * @author Pegasust
+ * @brief Low-overhead hot-path instrumentation: per-thread counters for
+ * triangles, allocations and bytes written plus per-phase timers, summed
+ * over all threads on demand, and, when memory tracking is on, the
+ * allocations per allocating function and the live and peak heap bytes.
+ * Compile with -DSTL3D_NO_STATS to remove it.
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include <time.h>
+#include "3d.h"
+
+const char* STATS3D_PHASE_NAMES[STATS3D_PHASE_COUNT] = {
+    "quadrilateral",
+    "cuboid",
+    "pyramid",
+    "sphere",
+    "fractal",
+    "weld",
+    "dedup",
+    "write_stl_text",
+    "write_stl_binary",
+    "write_ply_binary",
+    "write_obj"
+};
+
+#define STATS_OTHER_SITE "other"
+
+int Stats3D_find_site(const Stats3D* stats, const char* site) {
+    for(int i = 0; i < stats->site_count; ++i) {
+        if(!strcmp(stats->sites[i].site, site)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Adds allocations and bytes to the entry of site in out, making
+ * one if there is none. Sites only get STATS3D_MAX_SITES - 1 entries; the
+ * ones that do not fit share one more entry, "other".
+ */
+void Stats3D_add_site(Stats3D* out, const char* site, uint64_t allocations, uint64_t bytes) {
+    int i = Stats3D_find_site(out, site);
+    if(i < 0 && out->site_count < STATS3D_MAX_SITES - 1) {
+        i = out->site_count++;
+        out->sites[i] = (Stats3DSite){site, 0, 0};
+    } else if(i < 0) {
+        // sorting moves "other" around, so it is looked up by name as well
+        i = Stats3D_find_site(out, STATS_OTHER_SITE);
+        if(i < 0) {
+            i = out->site_count++;
+            out->sites[i] = (Stats3DSite){STATS_OTHER_SITE, 0, 0};
+        }
+    }
+    out->sites[i].allocations += allocations;
+    out->sites[i].bytes += bytes;
+}
+
+// qsort order of the sites: the most bytes first
+int Stats3DSite_compare(const void* a, const void* b) {
+    uint64_t x = ((const Stats3DSite*)a)->bytes, y = ((const Stats3DSite*)b)->bytes;
+    return x < y? 1: x > y? -1: 0;
+}
+
+#ifndef STL3D_NO_STATS
+
+// phases that run millions of times per job only read the clock on one
+// call out of STATS_SAMPLE_RATE and scale that time up
+#define STATS_SAMPLE_RATE 16
+#define STATS_SAMPLED(phase) ((phase) == STATS3D_QUADRILATERAL \
+    || (phase) == STATS3D_CUBOID || (phase) == STATS3D_PYRAMID)
+
+// the slots of a thread's allocation site table, twice the sites there are
+#define STATS_THREAD_SITES 128
+// a thread adds its allocations and frees to the process-wide live bytes
+// once they add up to this many, so the peak is exact to this per thread
+#define STATS_LIVE_FLUSH (64 * 1024)
+
+/**
+ * The allocations of one site on one thread. The table is keyed by the
+ * site name's address (__func__ is one array per function), so the hot
+ * path never compares strings.
+ */
+typedef struct Stats3DThreadSite {
+    const char* _Atomic site;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t bytes;
+} Stats3DThreadSite;
+
+/**
+ * The counters of one thread. Only the owning thread writes them, so a
+ * relaxed load + store is enough (no locked instruction); readers from
+ * other threads see a slightly stale but untorn value.
+ */
+typedef struct Stats3DThread {
+    _Atomic uint64_t triangles_emitted;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t bytes_allocated;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t phase_calls[STATS3D_PHASE_COUNT];
+    _Atomic uint64_t phase_ns[STATS3D_PHASE_COUNT];
+    Stats3DThreadSite sites[STATS_THREAD_SITES];
+    // not yet in stats_live_bytes / stats_live_allocations
+    _Atomic int64_t live_bytes;
+    _Atomic int64_t live_allocations;
+    // only touched by the owning thread
+    int phase_depth[STATS3D_PHASE_COUNT];
+    uint64_t phase_seen[STATS3D_PHASE_COUNT];
+    uint64_t phase_start[STATS3D_PHASE_COUNT];
+    struct Stats3DThread* next;
+} Stats3DThread;
+
+_Thread_local Stats3DThread* stats_local = NULL;
+
+// every live thread's counters, and the totals of the threads that exited
+Stats3DThread* stats_threads = NULL;
+Stats3D stats_retired;
+mtx_t stats_lock;
+tss_t stats_key;
+once_flag stats_once = ONCE_FLAG_INIT;
+
+// memory is often freed by another thread than the one that allocated it,
+// so the live bytes are one process-wide counter (plus every thread's
+// unflushed share)
+_Atomic int64_t stats_live_bytes;
+_Atomic int64_t stats_live_allocations;
+_Atomic int64_t stats_peak_bytes;
+
+// the site, live and peak counters are only kept while this is set: they
+// cost a table lookup per allocation and a counter update per free
+atomic_int stats_memory = 0;
+
+void stats_add(_Atomic uint64_t* counter, uint64_t n) {
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+uint64_t stats_load(_Atomic uint64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds the counters of t to out.
+ */
+void Stats3DThread_sum(Stats3DThread* t, Stats3D* out) {
+    out->triangles_emitted += stats_load(&t->triangles_emitted);
+    out->allocations += stats_load(&t->allocations);
+    out->bytes_allocated += stats_load(&t->bytes_allocated);
+    out->bytes_written += stats_load(&t->bytes_written);
+    for(int p = 0; p < STATS3D_PHASE_COUNT; ++p) {
+        out->phase_calls[p] += stats_load(&t->phase_calls[p]);
+        out->phase_ns[p] += stats_load(&t->phase_ns[p]);
+    }
+    for(int i = 0; i < STATS_THREAD_SITES; ++i) {
+        const char* site = atomic_load_explicit(&t->sites[i].site, memory_order_acquire);
+        if(site != NULL) {
+            Stats3D_add_site(out, site, stats_load(&t->sites[i].allocations),
+                stats_load(&t->sites[i].bytes));
+        }
+    }
+}
+
+/**
+ * @brief Moves t's share of the live bytes into the process-wide counters
+ * and raises the peak to what they reach.
+ */
+void Stats3DThread_flush_live(Stats3DThread* t) {
+    int64_t bytes = atomic_load_explicit(&t->live_bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats_live_allocations,
+        atomic_load_explicit(&t->live_allocations, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&t->live_allocations, 0, memory_order_relaxed);
+    atomic_store_explicit(&t->live_bytes, 0, memory_order_relaxed);
+    int64_t live = atomic_fetch_add_explicit(&stats_live_bytes, bytes, memory_order_relaxed) + bytes;
+    int64_t peak = atomic_load_explicit(&stats_peak_bytes, memory_order_relaxed);
+    while(live > peak && !atomic_compare_exchange_weak_explicit(&stats_peak_bytes,
+        &peak, live, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * @brief tss destructor: folds an exiting thread's counters into the
+ * retired totals so they outlive it.
+ */
+void stats_thread_exit(void* arg) {
+    Stats3DThread* t = arg;
+    mtx_lock(&stats_lock);
+    Stats3DThread_flush_live(t);
+    Stats3DThread_sum(t, &stats_retired);
+    for(Stats3DThread** iter = &stats_threads; *iter != NULL; iter = &(*iter)->next) {
+        if(*iter == t) {
+            *iter = t->next;
+            break;
+        }
+    }
+    mtx_unlock(&stats_lock);
+    free(t);
+}
+
+void stats_dump_at_exit() {
+    const char* target = getenv("STL3D_STATS");
+    size_t len = strlen(target);
+    int json = !strcmp(target, "json") || (len > 5 && !strcmp(target + len - 5, ".json"));
+    FILE* f = stderr;
+    if(strcmp(target, "1") != 0 && strcmp(target, "stderr") != 0 && strcmp(target, "json") != 0) {
+        f = fopen(target, "w");
+        if(f == NULL) {
+            f = stderr;
+        }
+    }
+    Stats3D stats;
+    Stats3D_snapshot(&stats);
+    if(json) {
+        Stats3D_dump_json(&stats, f);
+    } else {
+        Stats3D_dump(&stats, f);
+    }
+    if(f != stderr) {
+        fclose(f);
+    }
+}
+
+void stats_init() {
+    mtx_init(&stats_lock, mtx_plain);
+    tss_create(&stats_key, stats_thread_exit);
+    memset(&stats_retired, 0, sizeof(stats_retired));
+    const char* target = getenv("STL3D_STATS");
+    if(target != NULL && *target != '\0' && strcmp(target, "0") != 0) {
+        atomic_store_explicit(&stats_memory, 1, memory_order_relaxed);
+        atexit(stats_dump_at_exit);
+    }
+}
+
+/**
+ * @brief The calling thread's counters, registered on first use.
+ */
+Stats3DThread* stats_thread() {
+    if(stats_local != NULL) {
+        return stats_local;
+    }
+    call_once(&stats_once, stats_init);
+    Stats3DThread* t = calloc(1, sizeof(Stats3DThread));
+    if(t == NULL) {
+        return NULL;
+    }
+    mtx_lock(&stats_lock);
+    t->next = stats_threads;
+    stats_threads = t;
+    mtx_unlock(&stats_lock);
+    tss_set(stats_key, t);
+    stats_local = t;
+    return t;
+}
+
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_triangles(uint64_t n) {
+    Stats3DThread* t = stats_thread();
+    if(t != NULL) {
+        stats_add(&t->triangles_emitted, n);
+    }
+}
+
+/**
+ * @brief The calling thread's counters for site, added on first use.
+ *
+ * @return Stats3DThreadSite* the counters, NULL if the table is full
+ */
+Stats3DThreadSite* Stats3DThread_site(Stats3DThread* t, const char* site) {
+    size_t start = ((uintptr_t)site >> 4) % STATS_THREAD_SITES;
+    for(size_t n = 0; n < STATS_THREAD_SITES; ++n) {
+        Stats3DThreadSite* slot = &t->sites[(start + n) % STATS_THREAD_SITES];
+        const char* name = atomic_load_explicit(&slot->site, memory_order_relaxed);
+        if(name == site) {
+            return slot;
+        } else if(name == NULL) {
+            atomic_store_explicit(&slot->site, site, memory_order_release);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds to the calling thread's share of the live allocations and
+ * bytes, flushing it once it has grown (or shrunk) by STATS_LIVE_FLUSH.
+ */
+void stats_live(Stats3DThread* t, int64_t allocations, int64_t bytes) {
+    atomic_store_explicit(&t->live_allocations,
+        atomic_load_explicit(&t->live_allocations, memory_order_relaxed) + allocations,
+        memory_order_relaxed);
+    int64_t live = atomic_load_explicit(&t->live_bytes, memory_order_relaxed) + bytes;
+    atomic_store_explicit(&t->live_bytes, live, memory_order_relaxed);
+    if(live >= STATS_LIVE_FLUSH || live <= -STATS_LIVE_FLUSH) {
+        Stats3DThread_flush_live(t);
+    }
+}
+
+void stats_alloc(const char* site, uint64_t bytes) {
+    Stats3DThread* t = stats_thread();
+    if(t != NULL) {
+        stats_add(&t->allocations, 1);
+        stats_add(&t->bytes_allocated, bytes);
+        if(!atomic_load_explicit(&stats_memory, memory_order_relaxed)) {
+            return;
+        }
+        Stats3DThreadSite* counters = Stats3DThread_site(t, site);
+        if(counters != NULL) {
+            stats_add(&counters->allocations, 1);
+            stats_add(&counters->bytes, bytes);
+        }
+        stats_live(t, 1, bytes);
+    }
+}
+
+void stats_free(uint64_t bytes) {
+    if(!atomic_load_explicit(&stats_memory, memory_order_relaxed)) {
+        return;
+    }
+    Stats3DThread* t = stats_thread();
+    if(t != NULL) {
+        stats_live(t, -1, -(int64_t)bytes);
+    }
+}
+
+void stats_written(uint64_t bytes) {
+    Stats3DThread* t = stats_thread();
+    if(t != NULL) {
+        stats_add(&t->bytes_written, bytes);
+    }
+}
+
+/**
+ * @brief Starts timing phase on this thread. Recursive and nested calls of
+ * the same phase are folded into the outermost one.
+ */
+void stats_phase_begin(enum Stats3DPhase phase) {
+    Stats3DThread* t = stats_thread();
+    if(t == NULL || t->phase_depth[phase]++ != 0) {
+        return;
+    }
+    // phase_start == 0 marks a call that is counted but not timed
+    t->phase_start[phase] = 0;
+    if(!STATS_SAMPLED(phase) || t->phase_seen[phase] % STATS_SAMPLE_RATE == 0) {
+        t->phase_start[phase] = stats_now_ns();
+    }
+    ++t->phase_seen[phase];
+}
+
+void stats_phase_end(enum Stats3DPhase phase) {
+    Stats3DThread* t = stats_local;
+    if(t == NULL || --t->phase_depth[phase] != 0) {
+        return;
+    }
+    if(t->phase_start[phase] != 0) {
+        uint64_t ns = stats_now_ns() - t->phase_start[phase];
+        stats_add(&t->phase_ns[phase], STATS_SAMPLED(phase)? ns * STATS_SAMPLE_RATE: ns);
+    }
+    stats_add(&t->phase_calls[phase], 1);
+}
+
+#define STATS_TRIANGLES(n) stats_triangles(n)
+#define STATS_ALLOC(site, bytes) stats_alloc(site, bytes)
+#define STATS_FREE(bytes) stats_free(bytes)
+#define STATS_WRITTEN(bytes) stats_written(bytes)
+#define STATS_BEGIN(phase) stats_phase_begin(phase)
+#define STATS_END(phase) stats_phase_end(phase)
+
+void Stats3D_snapshot(Stats3D* out) {
+    call_once(&stats_once, stats_init);
+    int64_t live = atomic_load_explicit(&stats_live_bytes, memory_order_relaxed);
+    int64_t live_allocations = atomic_load_explicit(&stats_live_allocations, memory_order_relaxed);
+    mtx_lock(&stats_lock);
+    *out = stats_retired;
+    for(Stats3DThread* t = stats_threads; t != NULL; t = t->next) {
+        Stats3DThread_sum(t, out);
+        live += atomic_load_explicit(&t->live_bytes, memory_order_relaxed);
+        live_allocations += atomic_load_explicit(&t->live_allocations, memory_order_relaxed);
+    }
+    mtx_unlock(&stats_lock);
+    // a thread's share may be negative (it frees what others allocated),
+    // and the total dips below 0 while a flush races this snapshot
+    out->live_bytes = live > 0? (uint64_t)live: 0;
+    out->live_allocations = live_allocations > 0? (uint64_t)live_allocations: 0;
+    int64_t peak = atomic_load_explicit(&stats_peak_bytes, memory_order_relaxed);
+    uint64_t peak_bytes = peak > 0? (uint64_t)peak: 0;
+    out->peak_bytes = peak_bytes > out->live_bytes? peak_bytes: out->live_bytes;
+    qsort(out->sites, out->site_count, sizeof(Stats3DSite), Stats3DSite_compare);
+}
+
+void Stats3D_reset_peak() {
+    Stats3D stats;
+    Stats3D_snapshot(&stats);
+    atomic_store_explicit(&stats_peak_bytes, stats.live_bytes, memory_order_relaxed);
+}
+
+void Stats3D_set_memory_tracking(int enabled) {
+    call_once(&stats_once, stats_init);
+    atomic_store_explicit(&stats_memory, enabled != 0, memory_order_relaxed);
+}
+
+#else
+
+#define STATS_TRIANGLES(n) ((void)0)
+#define STATS_ALLOC(site, bytes) ((void)0)
+#define STATS_FREE(bytes) ((void)0)
+#define STATS_WRITTEN(bytes) ((void)0)
+#define STATS_BEGIN(phase) ((void)0)
+#define STATS_END(phase) ((void)0)
+
+void Stats3D_snapshot(Stats3D* out) {
+    memset(out, 0, sizeof(Stats3D));
+}
+
+void Stats3D_reset_peak() {
+}
+
+void Stats3D_set_memory_tracking(int enabled) {
+}
+
+#endif
+
+double Stats3D_bytes_per_triangle(const Stats3D* stats) {
+    uint64_t triangles = stats->objects > 0? (uint64_t)stats->triangles: stats->triangles_emitted;
+    return triangles > 0? (double)stats->live_bytes / triangles: 0.0;
+}
+
+void Stats3D_dump(const Stats3D* stats, FILE* f) {
+    fprintf(f, "stl3d stats:\n");
+    if(stats->objects > 0) {
+        fprintf(f, "  scene:             %ld objects, %ld triangles\n",
+            stats->objects, stats->triangles);
+    }
+    fprintf(f, "  triangles emitted: %llu\n", (unsigned long long)stats->triangles_emitted);
+    fprintf(f, "  allocations:       %llu (%llu bytes)\n",
+        (unsigned long long)stats->allocations, (unsigned long long)stats->bytes_allocated);
+    fprintf(f, "  live memory:       %llu bytes in %llu allocations (peak %llu bytes)\n",
+        (unsigned long long)stats->live_bytes, (unsigned long long)stats->live_allocations,
+        (unsigned long long)stats->peak_bytes);
+    fprintf(f, "  bytes/triangle:    %.1f\n", Stats3D_bytes_per_triangle(stats));
+    fprintf(f, "  bytes written:     %llu\n", (unsigned long long)stats->bytes_written);
+    for(int p = 0; p < STATS3D_PHASE_COUNT; ++p) {
+        if(stats->phase_calls[p] == 0) {
+            continue;
+        }
+        fprintf(f, "  %-17s  %llu calls, %.6f s\n", STATS3D_PHASE_NAMES[p],
+            (unsigned long long)stats->phase_calls[p], stats->phase_ns[p] / 1e9);
+    }
+    for(int i = 0; i < stats->site_count; ++i) {
+        fprintf(f, "  alloc %-29s  %llu calls, %llu bytes\n", stats->sites[i].site,
+            (unsigned long long)stats->sites[i].allocations,
+            (unsigned long long)stats->sites[i].bytes);
+    }
+}
+
+void Stats3D_dump_json(const Stats3D* stats, FILE* f) {
+    fprintf(f, "{\"triangles_emitted\": %llu, \"allocations\": %llu, \"bytes_allocated\": %llu, "
+        "\"bytes_written\": %llu, \"live_bytes\": %llu, \"live_allocations\": %llu, "
+        "\"peak_bytes\": %llu, \"bytes_per_triangle\": %.3f, \"objects\": %ld, \"triangles\": %ld",
+        (unsigned long long)stats->triangles_emitted, (unsigned long long)stats->allocations,
+        (unsigned long long)stats->bytes_allocated, (unsigned long long)stats->bytes_written,
+        (unsigned long long)stats->live_bytes, (unsigned long long)stats->live_allocations,
+        (unsigned long long)stats->peak_bytes, Stats3D_bytes_per_triangle(stats),
+        stats->objects, stats->triangles);
+    fprintf(f, ", \"phases\": {");
+    for(int p = 0; p < STATS3D_PHASE_COUNT; ++p) {
+        fprintf(f, "%s\"%s\": {\"calls\": %llu, \"seconds\": %.9f}", p > 0? ", ": "",
+            STATS3D_PHASE_NAMES[p], (unsigned long long)stats->phase_calls[p],
+            stats->phase_ns[p] / 1e9);
+    }
+    // site names are C function names, nothing to escape
+    fprintf(f, "}, \"sites\": {");
+    for(int i = 0; i < stats->site_count; ++i) {
+        fprintf(f, "%s\"%s\": {\"allocations\": %llu, \"bytes\": %llu}", i > 0? ", ": "",
+            stats->sites[i].site, (unsigned long long)stats->sites[i].allocations,
+            (unsigned long long)stats->sites[i].bytes);
+    }
+    fprintf(f, "}}\n");
+}
+
+void Scene3D_stats(Scene3D* scene, Stats3D* out) {
+    Stats3D_snapshot(out);
+    const Stats3D* base = &scene->stats_baseline;
+    out->triangles_emitted -= base->triangles_emitted;
+    out->allocations -= base->allocations;
+    out->bytes_allocated -= base->bytes_allocated;
+    out->bytes_written -= base->bytes_written;
+    for(int p = 0; p < STATS3D_PHASE_COUNT; ++p) {
+        out->phase_calls[p] -= base->phase_calls[p];
+        out->phase_ns[p] -= base->phase_ns[p];
+    }
+    // every site of the baseline is still in out, counters only grow
+    for(int i = 0; i < base->site_count; ++i) {
+        Stats3D_add_site(out, base->sites[i].site, -base->sites[i].allocations,
+            -base->sites[i].bytes);
+    }
+    int sites = 0;
+    for(int i = 0; i < out->site_count; ++i) {
+        if(out->sites[i].allocations != 0) {
+            out->sites[sites++] = out->sites[i];
+        }
+    }
+    out->site_count = sites;
+    qsort(out->sites, out->site_count, sizeof(Stats3DSite), Stats3DSite_compare);
+    out->objects = scene->count;
+    out->triangles = 0;
+    for(long i = 0; i < scene->count; ++i) {
+        out->triangles += scene->objects[i]->count;
+    }
+}
@@ -9,39 +9,12 @@
  * 
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
 #include "3d.h"
 
-void Scene3D_fwrite_stl_text(Scene3D* scene, FILE* f) {
-    fprintf(f, "solid scene\n");
-    for(int i = 0; i < scene->count; ++i) {
-        Object3D* object = scene->objects[i];
-        int j = 0;
-        for(Triangle3DNode* tri_iter = object->root; tri_iter != NULL; tri_iter = tri_iter->next) {
-            fprintf(f, "  facet normal 0.0 0.0 0.0\n");
-            fprintf(f, "    outer loop\n");
-            ++j;
-            Coordinate3D* tris[3] = {
-                &tri_iter->triangle.a,
-                &tri_iter->triangle.b,
-                &tri_iter->triangle.c
-            };
-            for(int e = 0; e < 3; ++e) {
-                fprintf(f, "    vertex %.5f %.5f %.5f\n",
-                    tris[e]->x, tris[e]->y, tris[e]->z);
-            }
-            fprintf(f, "    endloop\n");
-            fprintf(f, "  endfacet\n");
-        }
-        if(j != object->count) {
-            fprintf(stderr, "j (%d) != count (%ld)\n", j, object->count);
-        }
-    }
-    fprintf(f, "endsolid scene\n");
-}
-
 const uint8_t* get_header() {
     static uint8_t header[80];
     static uint8_t initialized = 0;
@@ -52,53 +25,466 @@ const uint8_t* get_header() {
     return header;
 }
 
-void Scene3D_fwrite_stl_binary(Scene3D* scene, FILE* f) {
+// worst case of "%.5f" on a double is 309 integer digits, a sign, the point
+// and 5 decimals; a facet is 7 lines with at most 3 of those per line
+#define STL_TEXT_FACET_MAX_LEN 4096
+#define STL_BINARY_FACET_LEN 50
+
+/**
+ * @brief Formats one facet in the STL text format.
+ * 
+ * @param t 
+ * @param out at least STL_TEXT_FACET_MAX_LEN bytes
+ * @return size_t number of bytes written to out (no NUL terminator counted)
+ */
+size_t Triangle3D_encode_stl_text(const Triangle3D* t, char* out) {
+    const Coordinate3D* tris[3] = {&t->a, &t->b, &t->c};
+    size_t len = 0;
+    len += sprintf(out + len, "  facet normal 0.0 0.0 0.0\n");
+    len += sprintf(out + len, "    outer loop\n");
+    for(int e = 0; e < 3; ++e) {
+        len += sprintf(out + len, "    vertex %.5f %.5f %.5f\n",
+            tris[e]->x, tris[e]->y, tris[e]->z);
+    }
+    len += sprintf(out + len, "    endloop\n");
+    len += sprintf(out + len, "  endfacet\n");
+    return len;
+}
+
+/**
+ * @brief Packs one facet into the 50 bytes of the STL binary format,
+ * little-endian like the rest of the format whatever the host order.
+ * The normal is not supported by the data structure, so it's all 0, and so
+ * is the attribute.
+ * 
+ * @param t 
+ * @param out at least STL_BINARY_FACET_LEN bytes
+ */
+void Triangle3D_encode_stl_binary(const Triangle3D* t, unsigned char* out) {
+    const Coordinate3D* tris[3] = {&t->a, &t->b, &t->c};
+    float values[12] = {0.0f, 0.0f, 0.0f};
+    for(int i = 0; i < 3; ++i) {
+        values[3 + i*3 + 0] = tris[i]->x;
+        values[3 + i*3 + 1] = tris[i]->y;
+        values[3 + i*3 + 2] = tris[i]->z;
+    }
+    for(int i = 0; i < 12; ++i) {
+        uint32_t bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        put_le32(out + i*4, bits);
+    }
+    // the attribute
+    out[48] = 0;
+    out[49] = 0;
+}
+
+/**
+ * @brief The number of facets in the scene, which binary STL stores in a
+ * uint32.
+ *
+ * @return long the count, or -1 if it does not fit in a uint32
+ */
+long Scene3D_facet_count(Scene3D* scene) {
+    long facet_count = 0;
+    for(long i = 0; i < scene->count; ++i) {
+        facet_count += scene->objects[i]->count;
+        if(facet_count > UINT32_MAX) {
+            return -1;
+        }
+    }
+    return facet_count;
+}
+
+#define PLY_VERTEX_LEN 12
+#define PLY_FACE_LEN 13
+// "v " or "f " with 3 numbers; each at most STL_TEXT_FACET_MAX_LEN / 3
+#define OBJ_LINE_MAX_LEN STL_TEXT_FACET_MAX_LEN
+
+// a typical text facet takes about 200 bytes
+#define STL_TEXT_FACET_TYPICAL_LEN 256
+
+/**
+ * @brief Streams the facets of one object as STL text into w.
+ * 
+ * @param object 
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int Object3D_encode_stl_text(const Object3D* object, AsyncWriter3D* w) {
+    long j = 0;
+    Triangle3DIterator iter;
+    Triangle3D triangle;
+    Triangle3DIterator_init(&iter, object);
+    while(Triangle3DIterator_next(&iter, &triangle)) {
+        char* out = (char*)AsyncWriter3D_reserve(w, STL_TEXT_FACET_MAX_LEN);
+        if(out == NULL) {
+            return -1;
+        }
+        AsyncWriter3D_commit(w, Triangle3D_encode_stl_text(&triangle, out));
+        ++j;
+    }
+    if(j != object->count) {
+        fprintf(stderr, "j (%ld) != count (%ld)\n", j, object->count);
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams the facets of one object as binary STL into w.
+ * 
+ * @param object 
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int Object3D_encode_stl_binary(const Object3D* object, AsyncWriter3D* w) {
+    Triangle3DIterator iter;
+    Triangle3D triangle;
+    Triangle3DIterator_init(&iter, object);
+    while(Triangle3DIterator_next(&iter, &triangle)) {
+        unsigned char* out = AsyncWriter3D_reserve(w, STL_BINARY_FACET_LEN);
+        if(out == NULL) {
+            return -1;
+        }
+        Triangle3D_encode_stl_binary(&triangle, out);
+        AsyncWriter3D_commit(w, STL_BINARY_FACET_LEN);
+    }
+    return 0;
+}
+
+/**
+ * @brief Encodes all facets of object into a new blob.
+ * 
+ * @param object 
+ * @param binary 1 for binary STL, 0 for STL text
+ * @param out 
+ * @return int 0 on success, -1 if the blob could not be allocated (or the
+ * object is empty, which has nothing worth caching)
+ */
+int Object3D_encode_stl_blob(const Object3D* object, int binary, EncodedFacets3D* out) {
+    if(object->count == 0) {
+        return -1;
+    }
+    // the blob is charged to the object's budget at exactly len bytes
+    size_t capacity = binary? object->count * STL_BINARY_FACET_LEN
+        : object->count * STL_TEXT_FACET_TYPICAL_LEN + STL_TEXT_FACET_MAX_LEN;
+    unsigned char* data = mem3d_malloc(object->budget, capacity);
+    if(data == NULL) {
+        return -1;
+    }
+    size_t len = 0;
+    Triangle3DIterator iter;
+    Triangle3D triangle;
+    Triangle3DIterator_init(&iter, object);
+    while(Triangle3DIterator_next(&iter, &triangle)) {
+        if(binary) {
+            Triangle3D_encode_stl_binary(&triangle, data + len);
+            len += STL_BINARY_FACET_LEN;
+            continue;
+        }
+        if(capacity - len < STL_TEXT_FACET_MAX_LEN) {
+            unsigned char* grown = mem3d_realloc(object->budget, data, capacity, capacity * 2);
+            if(grown == NULL) {
+                mem3d_free(object->budget, data, capacity);
+                return -1;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+        len += Triangle3D_encode_stl_text(&triangle, (char*)data + len);
+    }
+    if(len < capacity) {
+        // give the worst case slack back, the blob lives until the next edit
+        unsigned char* shrunk = mem3d_realloc(object->budget, data, capacity, len);
+        if(shrunk == NULL) {
+            mem3d_free(object->budget, data, capacity);
+            return -1;
+        }
+        data = shrunk;
+    }
+    *out = (EncodedFacets3D){data, len};
+    return 0;
+}
+
+/**
+ * @brief Writes the facets of object into w, from its cached blob when it
+ * has not changed since the last export, or encoding and caching them.
+ * An object whose blob cannot be allocated is streamed uncached.
+ * 
+ * @param object 
+ * @param binary 1 for binary STL, 0 for STL text
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int Object3D_encode_stl_cached(Object3D* object, int binary, AsyncWriter3D* w) {
+    if(object->dirty) {
+        // both formats are stale; dropping them keeps "cached and not
+        // dirty" meaning "up to date" for each of them
+        Object3D_drop_encoded(object);
+        object->dirty = 0;
+    }
+    EncodedFacets3D* blob = binary? &object->stl_binary: &object->stl_text;
+    if(blob->data == NULL && Object3D_encode_stl_blob(object, binary, blob) != 0) {
+        return binary? Object3D_encode_stl_binary(object, w): Object3D_encode_stl_text(object, w);
+    }
+    return AsyncWriter3D_write(w, blob->data, blob->len);
+}
+
+/**
+ * @brief Streams the scene as STL text into w.
+ * 
+ * @param scene 
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int Scene3D_encode_stl_text(Scene3D* scene, AsyncWriter3D* w) {
+    int status = AsyncWriter3D_write(w, "solid scene\n", strlen("solid scene\n"));
+    for(long i = 0; status == 0 && i < scene->count; ++i) {
+        status = scene->encoding_cache
+            ? Object3D_encode_stl_cached(scene->objects[i], 0, w)
+            : Object3D_encode_stl_text(scene->objects[i], w);
+    }
+    if(status == 0) {
+        status = AsyncWriter3D_write(w, "endsolid scene\n", strlen("endsolid scene\n"));
+    }
+    return status;
+}
+
+/**
+ * @brief Streams the scene as binary STL into w. With the encoding cache
+ * on, only the facet count is computed afresh; unchanged objects are
+ * copied from their blobs.
+ * 
+ * @param scene 
+ * @param w 
+ * @return int 0 on success, -1 if w failed or the scene has more facets
+ * than the format can count
+ */
+int Scene3D_encode_stl_binary(Scene3D* scene, AsyncWriter3D* w) {
+    long facet_count = Scene3D_facet_count(scene);
+    if(facet_count < 0) {
+        return -1;
+    }
     // first 80 bytes: header
     // should not begin with "solid"
     // can be anything
-    fwrite(get_header(), sizeof(uint8_t), 80, f);
+    int status = AsyncWriter3D_write(w, get_header(), 80);
+    // facet count (uint32_t, little-endian)
+    unsigned char count[4];
+    put_le32(count, (uint32_t)facet_count);
+    if(status == 0) {
+        status = AsyncWriter3D_write(w, count, sizeof(count));
+    }
+    // the facets, each is 50 bytes
+    for(long i = 0; status == 0 && i < scene->count; ++i) {
+        status = scene->encoding_cache
+            ? Object3D_encode_stl_cached(scene->objects[i], 1, w)
+            : Object3D_encode_stl_binary(scene->objects[i], w);
+    }
+    return status;
+}
 
-    // facet count (uint32_t)
-    uint32_t facet_count = 0;
-    for(uint32_t i = 0; i < scene->count; ++i) {
-        facet_count += scene->objects[i]->count;
+/**
+ * @brief Streams the mesh as binary little-endian PLY into w.
+ * 
+ * @param mesh 
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int IndexedMesh3D_encode_ply_binary(const IndexedMesh3D* mesh, AsyncWriter3D* w) {
+    char header[256];
+    int header_len = sprintf(header,
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "element vertex %ld\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "element face %ld\n"
+        "property list uchar uint vertex_indices\n"
+        "end_header\n", mesh->vertex_count, mesh->face_count);
+    int status = AsyncWriter3D_write(w, header, header_len);
+    for(long v = 0; status == 0 && v < mesh->vertex_count; ++v) {
+        unsigned char* out = AsyncWriter3D_reserve(w, PLY_VERTEX_LEN);
+        if(out == NULL) {
+            status = -1;
+            break;
+        }
+        for(int i = 0; i < 3; ++i) {
+            uint32_t bits;
+            memcpy(&bits, &mesh->vertices[v*3 + i], sizeof(bits));
+            put_le32(out + i*4, bits);
+        }
+        AsyncWriter3D_commit(w, PLY_VERTEX_LEN);
+    }
+    for(long f = 0; status == 0 && f < mesh->face_count; ++f) {
+        unsigned char* out = AsyncWriter3D_reserve(w, PLY_FACE_LEN);
+        if(out == NULL) {
+            status = -1;
+            break;
+        }
+        out[0] = 3;
+        for(int i = 0; i < 3; ++i) {
+            put_le32(out + 1 + i*4, mesh->indices[f*3 + i]);
+        }
+        AsyncWriter3D_commit(w, PLY_FACE_LEN);
     }
-    fwrite(&facet_count, sizeof(uint32_t), 1, f);
+    return status;
+}
 
-    // the facets, each is 50 bytes
-    for(uint32_t facets_i = 0; facets_i < scene->count; ++facets_i) {
-        for(Triangle3DNode* iter = scene->objects[facets_i]->root; iter != NULL; iter = iter->next) {
-            // 12 bytes normal: 3x4-byte FP (float)
-            // not supported by the data structure, so it's all 0
-            float norms[] = {0.0f, 0.0f, 0.0f};
-            fwrite(&norms, sizeof(norms[0]), sizeof(norms)/sizeof(norms[0]), f);
-            Coordinate3D* tris[3] = {
-                &iter->triangle.a,
-                &iter->triangle.b,
-                &iter->triangle.c
-            };
-            // 9x4-byte floats: coordinates of corners
-            for(int i = 0; i < 3; ++i) {
-                norms[0] = tris[i]->x;
-                norms[1] = tris[i]->y;
-                norms[2] = tris[i]->z;
-                fwrite(&norms, sizeof(norms[0]), sizeof(norms)/sizeof(norms[0]), f);
-            }
-            // attribute: not supported, just 0 for now
-            uint16_t attribute = 0;
-            fwrite(&attribute, sizeof(attribute), 1, f);
+/**
+ * @brief Streams the mesh as Wavefront OBJ into w.
+ * 
+ * @param mesh 
+ * @param w 
+ * @return int 0 on success, -1 if w failed
+ */
+int IndexedMesh3D_encode_obj(const IndexedMesh3D* mesh, AsyncWriter3D* w) {
+    int status = AsyncWriter3D_write(w, "o scene\n", strlen("o scene\n"));
+    for(long v = 0; status == 0 && v < mesh->vertex_count; ++v) {
+        char* out = (char*)AsyncWriter3D_reserve(w, OBJ_LINE_MAX_LEN);
+        if(out == NULL) {
+            status = -1;
+            break;
+        }
+        const float* c = &mesh->vertices[v*3];
+        AsyncWriter3D_commit(w, sprintf(out, "v %.5f %.5f %.5f\n", c[0], c[1], c[2]));
+    }
+    for(long f = 0; status == 0 && f < mesh->face_count; ++f) {
+        char* out = (char*)AsyncWriter3D_reserve(w, OBJ_LINE_MAX_LEN);
+        if(out == NULL) {
+            status = -1;
+            break;
         }
+        // OBJ indices are 1-based
+        const uint32_t* idx = &mesh->indices[f*3];
+        AsyncWriter3D_commit(w, sprintf(out, "f %lu %lu %lu\n",
+            idx[0] + 1ul, idx[1] + 1ul, idx[2] + 1ul));
     }
+    return status;
 }
 
-void Scene3D_write_stl_text(Scene3D* scene, char* file_name) {
-    FILE* f = fopen(file_name, "w");
-    Scene3D_fwrite_stl_text(scene, f);
-    fclose(f);
+/**
+ * @brief Runs encode over an AsyncWriter3D draining into sink, then closes
+ * everything.
+ * 
+ * @param sink consumed, may be NULL (failed to open)
+ * @param encode 
+ * @param data the scene or mesh to pass to encode
+ * @return int 0 on success, -1 if opening, encoding or closing failed
+ */
+int swrite_with(OutputSink3D* sink,
+    int (*encode)(const void* data, AsyncWriter3D* w), const void* data)
+{
+    AsyncWriter3D* w = AsyncWriter3D_open_sink(sink);
+    if(w == NULL) {
+        return -1;
+    }
+    int status = encode(data, w);
+    if(AsyncWriter3D_close(w) != 0) {
+        status = -1;
+    }
+    return status;
 }
 
-void Scene3D_write_stl_binary(Scene3D* scene, char* file_name) {
-    FILE* f = fopen(file_name, "wb");
-    Scene3D_fwrite_stl_binary(scene, f);
-    fclose(f);
-}
\ No newline at end of file
+int encode_stl_text(const void* scene, AsyncWriter3D* w) {
+    return Scene3D_encode_stl_text((Scene3D*)scene, w);
+}
+int encode_stl_binary(const void* scene, AsyncWriter3D* w) {
+    return Scene3D_encode_stl_binary((Scene3D*)scene, w);
+}
+int encode_ply_binary(const void* mesh, AsyncWriter3D* w) {
+    return IndexedMesh3D_encode_ply_binary(mesh, w);
+}
+int encode_obj(const void* mesh, AsyncWriter3D* w) {
+    return IndexedMesh3D_encode_obj(mesh, w);
+}
+
+int Scene3D_swrite_stl_text(Scene3D* scene, OutputSink3D* sink) {
+    STATS_BEGIN(STATS3D_WRITE_STL_TEXT);
+    int status = swrite_with(sink, encode_stl_text, scene);
+    STATS_END(STATS3D_WRITE_STL_TEXT);
+    return status;
+}
+
+int Scene3D_swrite_stl_binary(Scene3D* scene, OutputSink3D* sink) {
+    STATS_BEGIN(STATS3D_WRITE_STL_BINARY);
+    int status = swrite_with(sink, encode_stl_binary, scene);
+    STATS_END(STATS3D_WRITE_STL_BINARY);
+    return status;
+}
+
+int IndexedMesh3D_swrite_ply_binary(const IndexedMesh3D* mesh, OutputSink3D* sink) {
+    STATS_BEGIN(STATS3D_WRITE_PLY_BINARY);
+    int status = swrite_with(sink, encode_ply_binary, mesh);
+    STATS_END(STATS3D_WRITE_PLY_BINARY);
+    return status;
+}
+
+int IndexedMesh3D_swrite_obj(const IndexedMesh3D* mesh, OutputSink3D* sink) {
+    STATS_BEGIN(STATS3D_WRITE_OBJ);
+    int status = swrite_with(sink, encode_obj, mesh);
+    STATS_END(STATS3D_WRITE_OBJ);
+    return status;
+}
+
+int Scene3D_swrite_ply_binary(Scene3D* scene, OutputSink3D* sink) {
+    IndexedMesh3D* mesh = IndexedMesh3D_from_scene(scene);
+    if(mesh == NULL) {
+        if(sink != NULL) {
+            sink->close(sink);
+        }
+        return -1;
+    }
+    int status = IndexedMesh3D_swrite_ply_binary(mesh, sink);
+    IndexedMesh3D_destroy(mesh);
+    return status;
+}
+
+int Scene3D_swrite_obj(Scene3D* scene, OutputSink3D* sink) {
+    IndexedMesh3D* mesh = IndexedMesh3D_from_scene(scene);
+    if(mesh == NULL) {
+        if(sink != NULL) {
+            sink->close(sink);
+        }
+        return -1;
+    }
+    int status = IndexedMesh3D_swrite_obj(mesh, sink);
+    IndexedMesh3D_destroy(mesh);
+    return status;
+}
+
+// FILE* entry points: the caller keeps ownership of f
+
+int Scene3D_fwrite_stl_text(Scene3D* scene, FILE* f) {
+    return Scene3D_swrite_stl_text(scene, OutputSink3D_from_file(f));
+}
+
+int Scene3D_fwrite_stl_binary(Scene3D* scene, FILE* f) {
+    return Scene3D_swrite_stl_binary(scene, OutputSink3D_from_file(f));
+}
+
+// file name entry points
+
+int Scene3D_write_stl_text(Scene3D* scene, char* file_name) {
+    return Scene3D_swrite_stl_text(scene, OutputSink3D_open_file(file_name, "w"));
+}
+
+int Scene3D_write_stl_binary(Scene3D* scene, char* file_name) {
+    return Scene3D_swrite_stl_binary(scene, OutputSink3D_open_file(file_name, "wb"));
+}
+
+int IndexedMesh3D_write_ply_binary(const IndexedMesh3D* mesh, char* file_name) {
+    return IndexedMesh3D_swrite_ply_binary(mesh, OutputSink3D_open_file(file_name, "wb"));
+}
+
+int IndexedMesh3D_write_obj(const IndexedMesh3D* mesh, char* file_name) {
+    return IndexedMesh3D_swrite_obj(mesh, OutputSink3D_open_file(file_name, "w"));
+}
+
+int Scene3D_write_ply_binary(Scene3D* scene, char* file_name) {
+    return Scene3D_swrite_ply_binary(scene, OutputSink3D_open_file(file_name, "wb"));
+}
+
+int Scene3D_write_obj(Scene3D* scene, char* file_name) {
+    return Scene3D_swrite_obj(scene, OutputSink3D_open_file(file_name, "w"));
+}
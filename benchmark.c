@@ -0,0 +1,430 @@
+/**
+ * @file benchmark.c
+ * @author Pegasust
+ * @brief A throughput benchmark for 3d.o: triangles/s of every factory,
+ * MB/s of every writer, the peak RSS and the library's own peak heap and
+ * heap bytes per triangle, printed as CSV so that runs from different
+ * versions can be compared
+ * @version 0.1
+ * @date 2022-04-19
+ *
+ */
+
+// clock_gettime, getrusage and getopt
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "3d.h"
+
+// cheap benchmarks are repeated until they ran for at least this long
+#define MIN_SECONDS 0.2
+// cheap objects are created in batches of this many, then freed untimed
+#define BATCH_OBJECTS 1000
+// the primitives of the batched scene benchmark
+#define BATCH_PRIMITIVES 64
+
+FILE* results;
+// rows that could not be measured; main exits non-zero if there are any
+int failures;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * @brief Prints one CSV row. Either rate may be 0 when it does not apply,
+ * as may bytes_per_triangle. The peak heap is the library's since the
+ * previous row.
+ */
+void report(const char* benchmark, const char* parameter,
+    long triangles, long bytes, double seconds, double bytes_per_triangle)
+{
+    Stats3D stats;
+    Stats3D_snapshot(&stats);
+    fprintf(results, "%s,%s,%ld,%ld,%.6f,%.0f,%.2f,%ld,%llu,%.1f\n",
+        benchmark, parameter, triangles, bytes, seconds,
+        seconds > 0? triangles / seconds: 0.0,
+        seconds > 0? bytes / seconds / 1e6: 0.0,
+        peak_rss_kb(), (unsigned long long)stats.peak_bytes, bytes_per_triangle);
+    fflush(results);
+    Stats3D_reset_peak();
+}
+
+/**
+ * @brief The library's live heap bytes per triangle of scene, the only
+ * scene alive.
+ */
+double scene_bytes_per_triangle(Scene3D* scene) {
+    Stats3D stats;
+    Scene3D_stats(scene, &stats);
+    return Stats3D_bytes_per_triangle(&stats);
+}
+
+typedef struct FactoryArgs {
+    const char* factory;
+    double a;
+    double b;
+    int i;
+} FactoryArgs;
+
+Object3D* make(const FactoryArgs* args, Coordinate3D origin) {
+    if(!strcmp(args->factory, "cuboid")) {
+        return Object3D_create_cuboid(origin, args->a, args->b, args->a);
+    } else if(!strcmp(args->factory, "pyramid")) {
+        char* directions[] = {"up", "down", "left", "right", "forward", "backward"};
+        return Object3D_create_pyramid(origin, args->a, args->b, directions[args->i % 6]);
+    } else if(!strcmp(args->factory, "sphere")) {
+        return Object3D_create_sphere(origin, args->a, args->b);
+    } else if(!strcmp(args->factory, "sphere_lod")) {
+        return Object3D_create_sphere_lod(origin, args->a, args->b);
+    }
+    return Object3D_create_fractal(origin, args->a, args->i);
+}
+
+/**
+ * @brief Appends object to scene, or frees it if that fails.
+ *
+ * @return int 0 on success, -1 if object is NULL (its factory failed) or
+ * could not be appended
+ */
+int append(Scene3D* scene, Object3D* object) {
+    if(object == NULL) {
+        return -1;
+    }
+    if(Scene3D_append(scene, object) != 0) {
+        Object3D_dtor(object);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Times a factory, repeating it until MIN_SECONDS have passed.
+ * A failed factory call aborts the row.
+ */
+void bench_factory(FactoryArgs args, const char* parameter) {
+    long triangles = 0;
+    double seconds = 0.0;
+    double bytes_per_triangle = 0.0;
+    long calls = 0;
+    char name[64];
+    sprintf(name, "factory_%s", args.factory);
+    while(seconds < MIN_SECONDS) {
+        Scene3D* scene = Scene3D_create();
+        if(scene == NULL) {
+            fprintf(stderr, "%s %s: Scene3D_create failed\n", name, parameter);
+            ++failures;
+            return;
+        }
+        double start = now();
+        for(int n = 0; n < BATCH_OBJECTS && seconds + (now() - start) < MIN_SECONDS; ++n) {
+            Object3D* object = make(&args, (Coordinate3D){calls % 100, 0, 0});
+            args.i += !strcmp(args.factory, "pyramid");
+            long count = object != NULL? object->count: 0;
+            if(append(scene, object) != 0) {
+                fprintf(stderr, "%s %s: creating object %ld failed\n", name, parameter, calls);
+                ++failures;
+                Scene3D_destroy(scene);
+                return;
+            }
+            triangles += count;
+            ++calls;
+        }
+        seconds += now() - start;
+        bytes_per_triangle = scene_bytes_per_triangle(scene);
+        Scene3D_destroy(scene);
+    }
+    report(name, parameter, triangles, 0, seconds, bytes_per_triangle);
+}
+
+/**
+ * @brief Times building (and destroying) one scene of count primitives,
+ * one Primitive3D_create + Scene3D_append at a time (threads == 0) or with
+ * Scene3D_append_primitives on threads threads. A failed primitive aborts
+ * the row.
+ */
+void bench_batch(const Primitive3D* primitives, long count, int threads, const char* parameter) {
+    long triangles = 0;
+    double seconds = 0.0;
+    double bytes_per_triangle = 0.0;
+    char name[64];
+    if(threads == 0) {
+        sprintf(name, "scene_one_by_one");
+    } else {
+        sprintf(name, "scene_batch_threads=%d", threads);
+    }
+    while(seconds < MIN_SECONDS) {
+        double start = now();
+        Scene3D* scene = Scene3D_create();
+        if(scene == NULL) {
+            fprintf(stderr, "%s %s: Scene3D_create failed\n", name, parameter);
+            ++failures;
+            return;
+        }
+        int status = 0;
+        if(threads == 0) {
+            for(long i = 0; status == 0 && i < count; ++i) {
+                status = append(scene, Primitive3D_create(&primitives[i]));
+            }
+        } else {
+            status = Scene3D_append_primitives(scene, primitives, count, threads);
+        }
+        if(status != 0) {
+            fprintf(stderr, "%s %s: creating the primitives failed\n", name, parameter);
+            ++failures;
+            Scene3D_destroy(scene);
+            return;
+        }
+        for(long i = 0; i < scene->count; ++i) {
+            triangles += scene->objects[i]->count;
+        }
+        // untimed, like the rest of the bookkeeping
+        double stats_start = now();
+        bytes_per_triangle = scene_bytes_per_triangle(scene);
+        seconds -= now() - stats_start;
+        Scene3D_destroy(scene);
+        seconds += now() - start;
+    }
+    report(name, parameter, triangles, 0, seconds, bytes_per_triangle);
+}
+
+long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0? (long)st.st_size: 0;
+}
+
+/**
+ * @brief Times every writer on scene. MB/s counts the bytes that reach the
+ * disk, i.e. the compressed size for the gzip writers.
+ */
+void bench_writers(Scene3D* scene, const char* parameter, const char* dir) {
+    long triangles = 0;
+    for(long i = 0; i < scene->count; ++i) {
+        triangles += scene->objects[i]->count;
+    }
+    const char* formats[] = {
+        "stl_text", "stl_binary", "ply_binary", "obj", "stl_text_gz", "stl_binary_gz"
+    };
+    char path[4096];
+    for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+        snprintf(path, sizeof(path), "%s/bench_%d.out", dir, (int)getpid());
+        double start = now();
+        int status = -1;
+        switch(f) {
+            case 0: status = Scene3D_write_stl_text(scene, path); break;
+            case 1: status = Scene3D_write_stl_binary(scene, path); break;
+            case 2: status = Scene3D_write_ply_binary(scene, path); break;
+            case 3: status = Scene3D_write_obj(scene, path); break;
+            case 4: status = Scene3D_swrite_stl_text(scene, OutputSink3D_open_gzip(path, 6, 0)); break;
+            case 5: status = Scene3D_swrite_stl_binary(scene, OutputSink3D_open_gzip(path, 6, 0)); break;
+        }
+        double seconds = now() - start;
+        char name[64];
+        sprintf(name, "writer_%s", formats[f]);
+        if(status != 0) {
+            fprintf(stderr, "%s failed writing to %s\n", name, path);
+            ++failures;
+        } else {
+            report(name, parameter, triangles, file_size(path), seconds, 0.0);
+        }
+        remove(path);
+    }
+}
+
+/**
+ * @brief Times re-exporting scene with the encoding cache on after moving
+ * one of its objects, against the first (full) export.
+ */
+void bench_reexport(Scene3D* scene, const char* parameter, const char* dir) {
+    long triangles = 0;
+    for(long i = 0; i < scene->count; ++i) {
+        triangles += scene->objects[i]->count;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_%d.out", dir, (int)getpid());
+    Scene3D_set_encoding_cache(scene, 1);
+    for(int binary = 0; binary < 2; ++binary) {
+        const char* names[2][2] = {
+            {"reexport_stl_text_first", "reexport_stl_text_edit"},
+            {"reexport_stl_binary_first", "reexport_stl_binary_edit"}
+        };
+        for(int pass = 0; pass < 2; ++pass) {
+            Object3D_translate(scene->objects[0], (Coordinate3D){pass? 1.0: 0.0, 0.0, 0.0});
+            double start = now();
+            int status = binary? Scene3D_write_stl_binary(scene, path): Scene3D_write_stl_text(scene, path);
+            double seconds = now() - start;
+            if(status != 0) {
+                fprintf(stderr, "%s failed writing to %s\n", names[binary][pass], path);
+                ++failures;
+            } else {
+                report(names[binary][pass], parameter, triangles, file_size(path), seconds, 0.0);
+            }
+        }
+    }
+    Scene3D_set_encoding_cache(scene, 0);
+    remove(path);
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr,
+        "usage: %s [-l max_fractal_level] [-s max_scene_pairs] [-d tmp_dir] [-o results.csv] [-m]\n"
+        "  -l  highest fractal level to sweep, 1..8 (default 8)\n"
+        "  -s  largest scene to write, in sphere+fractal pairs, at least 1\n"
+        "      (default 64)\n"
+        "  -d  directory the writer benchmarks write into (default .)\n"
+        "  -o  CSV output file (default stdout)\n"
+        "  -m  track the library's heap for the peak_heap_bytes and\n"
+        "      heap_bytes_per_triangle columns (0 otherwise), at some cost\n"
+        "      to the rates\n", argv0);
+}
+
+/**
+ * @brief Parses arg as a whole decimal number in [low, high].
+ *
+ * @return long the number, or -1 if arg is not one (low must be >= 0)
+ */
+long parse_range(const char* arg, long low, long high) {
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || value < low || value > high) {
+        return -1;
+    }
+    return value;
+}
+
+int main(int argc, char** argv) {
+    int max_level = 8;
+    long max_objects = 64;
+    const char* dir = ".";
+    results = stdout;
+    int opt;
+    while((opt = getopt(argc, argv, "l:s:d:o:m")) != -1) {
+        switch(opt) {
+            case 'l':
+                max_level = (int)parse_range(optarg, 1, 8);
+                if(max_level < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                // the scene sizes are stepped by * 4
+                max_objects = parse_range(optarg, 1, LONG_MAX / 4);
+                if(max_objects < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd': dir = optarg; break;
+            case 'm': Stats3D_set_memory_tracking(1); break;
+            case 'o':
+                results = fopen(optarg, "w");
+                if(results == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fprintf(results, "benchmark,parameter,triangles,bytes,seconds,triangles_per_s,mb_per_s,peak_rss_kb,"
+        "peak_heap_bytes,heap_bytes_per_triangle\n");
+    char parameter[64];
+
+    // factories, from cheapest to most expensive so peak RSS stays meaningful
+    bench_factory((FactoryArgs){"cuboid", 10, 20, 0}, "10x20x10");
+    bench_factory((FactoryArgs){"pyramid", 20, 30, 0}, "20x30");
+    double increments[] = {90, 60, 45, 30, 20, 10, 5, 2, 1, 0.5};
+    for(size_t i = 0; i < sizeof(increments) / sizeof(increments[0]); ++i) {
+        sprintf(parameter, "increment=%g", increments[i]);
+        bench_factory((FactoryArgs){"sphere", 45, increments[i], 0}, parameter);
+    }
+    double tolerances[] = {1, 0.1, 0.01, 0.001};
+    for(size_t i = 0; i < sizeof(tolerances) / sizeof(tolerances[0]); ++i) {
+        sprintf(parameter, "tolerance=%g", tolerances[i]);
+        bench_factory((FactoryArgs){"sphere_lod", 45, tolerances[i], 0}, parameter);
+    }
+    for(int level = 1; level <= max_level; ++level) {
+        sprintf(parameter, "level=%d", level);
+        bench_factory((FactoryArgs){"fractal", 50, 0, level}, parameter);
+    }
+
+    // the same scene of fractals, spheres, cuboids and pyramids built one
+    // object at a time and as one batch
+    Primitive3D primitives[BATCH_PRIMITIVES];
+    for(int i = 0; i < BATCH_PRIMITIVES; ++i) {
+        Primitive3D* p = &primitives[i];
+        memset(p, 0, sizeof(*p));
+        p->origin = (Coordinate3D){(i % 8) * 100, (i / 8) * 100, 0};
+        p->kind = (Primitive3DKind)(i % 4);
+        switch(p->kind) {
+            case PRIMITIVE3D_CUBOID: p->cuboid.width = p->cuboid.height = p->cuboid.depth = 10; break;
+            case PRIMITIVE3D_PYRAMID: p->pyramid.width = 20; p->pyramid.height = 30; break;
+            case PRIMITIVE3D_SPHERE: p->sphere.radius = 45; p->sphere.increment = 2; break;
+            case PRIMITIVE3D_FRACTAL: p->fractal.size = 50; p->fractal.levels = 5; break;
+            default: break;
+        }
+    }
+    sprintf(parameter, "primitives=%d", BATCH_PRIMITIVES);
+    bench_batch(primitives, BATCH_PRIMITIVES, 0, parameter);
+    bench_batch(primitives, BATCH_PRIMITIVES, 1, parameter);
+    if(System3D_cpu_count() > 1) {
+        bench_batch(primitives, BATCH_PRIMITIVES, System3D_cpu_count(), parameter);
+    }
+
+    // writers over scenes of growing size, each object a 5 degree sphere
+    // and a level 4 fractal
+    for(long objects = 1; objects <= max_objects; objects *= 4) {
+        Scene3D* scene = Scene3D_create();
+        int status = scene != NULL? 0: -1;
+        for(long i = 0; status == 0 && i < objects; ++i) {
+            Coordinate3D origin = {(i % 8) * 100, (i / 8) * 100, 0};
+            status = append(scene, Object3D_create_sphere(origin, 45, 5));
+            if(status == 0) {
+                status = append(scene, Object3D_create_fractal(origin, 50, 4));
+            }
+        }
+        sprintf(parameter, "objects=%ld", objects * 2);
+        if(status != 0) {
+            fprintf(stderr, "writers %s: building the scene failed\n", parameter);
+            ++failures;
+            if(scene != NULL) {
+                Scene3D_destroy(scene);
+            }
+            break;
+        }
+        bench_writers(scene, parameter, dir);
+        bench_reexport(scene, parameter, dir);
+        Scene3D_destroy(scene);
+    }
+
+    report("peak_rss", "", 0, 0, 0.0, 0.0);
+    if(results != stdout && fclose(results) != 0) {
+        perror("closing the results");
+        ++failures;
+    }
+    return failures > 0? 1: 0;
+}
@@ -1,113 +1,519 @@
 /**
  * @file generator.c
  * @author Pegasust
- * @brief A driver for 3d.o
+ * @brief A batch driver for 3d.o: reads scene description files (see
+ * default.scene) and builds and exports the scenes concurrently on a pool
+ * of threads, bounded by an in-flight memory budget
  * @version 0.1
  * @date 2022-04-19
- * 
+ *
  */
 
+// sysconf
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
+#include <unistd.h>
 #include "3d.h"
 
-void serialize(Scene3D* scene, char* filename) {
-    int flen = strlen(filename);
-    char *f_extended = malloc(flen + sizeof(".bin.stl"));
-    strncpy(f_extended, filename, flen);
-    strcpy(&f_extended[flen], ".stl");
-    Scene3D_write_stl_text(scene, f_extended);
-    printf("Wrote to %s\n", f_extended);
-    strcpy(&f_extended[flen], ".bin");
-    strcpy(&f_extended[strlen(f_extended)], ".stl");
-    Scene3D_write_stl_binary(scene, f_extended);
-    printf("Wrote to %s\n", f_extended);
-    free(f_extended);
+// a Triangle3DNode plus the malloc bookkeeping around it
+#define BYTES_PER_TRIANGLE (sizeof(Triangle3DNode) + 16)
+// the welded mesh of the indexed formats, per triangle at worst
+#define WELD_BYTES_PER_TRIANGLE (3 * 3 * sizeof(float) + 3 * sizeof(uint32_t) + 3 * 2 * sizeof(uint32_t))
+// a dedup pass's triangle key, hash and mark plus its hash table slots
+#define DEDUP_BYTES_PER_TRIANGLE (10 * sizeof(int64_t) + sizeof(uint64_t) + 1 + 4 * sizeof(long))
+// an AsyncWriter3D's swap buffers, plus the blocks of a gzip sink
+#define WRITER_BYTES (4u << 20)
+#define GZIP_WRITER_BYTES(threads) (WRITER_BYTES + 2u * (threads) * (2u * 128 * 1024))
+
+#define DEFAULT_CACHE_MB 256
+
+#define NAME_MAX_LEN 256
+#define LINE_MAX_LEN 1024
+
+enum OutputFormat {
+    FORMAT_STL_TEXT,
+    FORMAT_STL_BINARY,
+    FORMAT_PLY_BINARY,
+    FORMAT_OBJ,
+    FORMAT_COUNT
+};
+
+const char* FORMAT_NAMES[FORMAT_COUNT] = {"stl_text", "stl_binary", "ply_binary", "obj"};
+const char* FORMAT_EXTENSIONS[FORMAT_COUNT] = {".stl", ".bin.stl", ".ply", ".obj"};
+
+typedef struct SceneJob {
+    char name[NAME_MAX_LEN];
+    Primitive3D* primitives;
+    long count;
+    long size;
+    // bit f set: write format f; bit FORMAT_COUNT + f: gzip compressed
+    unsigned outputs;
+    // < 0: keep duplicate triangles, else Scene3D_dedup_triangles tolerance
+    double dedup;
+    size_t estimate;
+} SceneJob;
+
+/**
+ * The shared state of the worker threads. Jobs are handed out in file
+ * order and admitted in that same order, each waiting until its estimate
+ * fits in what is left of the budget (a job larger than the whole budget
+ * runs once nothing else is in flight). On top of the estimates, memory
+ * holds every scene's actual allocations to the same budget, so a job that
+ * outgrows its estimate fails instead of pushing the host into swap.
+ */
+typedef struct Batch {
+    SceneJob* jobs;
+    long count;
+    long size;
+    const char* output_dir;
+    size_t budget;
+    MemoryBudget3D* memory;
+    PrimitiveCache3D* cache;
+    // the compression threads of one gzip output, the CPUs shared out
+    // between the jobs running at once
+    int gzip_threads;
+    mtx_t lock;
+    cnd_t released;
+    long next_job;
+    long next_admit;
+    size_t in_flight;
+    long jobs_in_flight;
+    int failures;
+} Batch;
+
+size_t SceneJob_estimate(const SceneJob* job, int gzip_threads) {
+    long triangles = 0;
+    for(long i = 0; i < job->count; ++i) {
+        triangles += Primitive3D_triangles(&job->primitives[i]);
+    }
+    size_t bytes = triangles * BYTES_PER_TRIANGLE;
+    // dedup and the outputs run one after the other, so only the largest counts
+    size_t writer = job->dedup >= 0.0? triangles * DEDUP_BYTES_PER_TRIANGLE: 0;
+    for(int f = 0; f < FORMAT_COUNT; ++f) {
+        if(!(job->outputs & (1u << f))) {
+            continue;
+        }
+        size_t w = (job->outputs & (1u << (FORMAT_COUNT + f)))? GZIP_WRITER_BYTES(gzip_threads): WRITER_BYTES;
+        if(f == FORMAT_PLY_BINARY || f == FORMAT_OBJ) {
+            w += triangles * WELD_BYTES_PER_TRIANGLE;
+        }
+        writer = w > writer? w: writer;
+    }
+    return bytes + writer;
+}
+
+void* grow(void* array, long* size, size_t element) {
+    long new_size = *size > 0? *size * 2: 16;
+    void* grown = realloc(array, new_size * element);
+    if(grown == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *size = new_size;
+    return grown;
+}
+
+int parse_error(const char* file, int line, const char* message) {
+    fprintf(stderr, "%s:%d: %s\n", file, line, message);
+    return -1;
 }
 
-int main() {
-    // create star
-    Scene3D *star = Scene3D_create();
-    char* directions[] = {"up", "down", "left", "right", "forward", "backward"};
-    Coordinate3D origin = {100, 100, 100};
-    for(int i = 0; i < 6; ++i) {
-        Object3D *object = Object3D_create_pyramid(origin, 20, 30, directions[i]);
-        Scene3D_append(star, object);
-    }
-    serialize(star, "star");
-    Scene3D_destroy(star);
-
-    // create robo-lookalike
-    Coordinate3D coord;
-    Object3D *object;
-    Scene3D* face = Scene3D_create();
-    // head
-    coord = (Coordinate3D){25, 25, 25};
-    object = Object3D_create_cuboid(coord, 50, 50, 50);
-    Scene3D_append(face, object);
-    // eye
-    coord = (Coordinate3D){15, 40, 0};
-    object = Object3D_create_cuboid(coord, 10, 10, 10);
-    Scene3D_append(face, object);
-
-    // eye
-    coord = (Coordinate3D){35, 40, 0};
-    object = Object3D_create_cuboid(coord, 10, 10, 10);
-    Scene3D_append(face, object);
-    // mouth
-    coord = (Coordinate3D){25, 15, 0};
-    object = Object3D_create_cuboid(coord, 30, 7, 10);
-    Scene3D_append(face, object);
-    serialize(face, "face");
-    Scene3D_destroy(face);
-
-    // pyramid
-    Scene3D *pyramid = Scene3D_create();
-    object = Object3D_create_pyramid((Coordinate3D){0,0,0},50, 75, "up");
-    Scene3D_append(pyramid, object);
-
-    serialize(pyramid, "pyramid");
-
-    Scene3D_destroy(pyramid);
-
-    // sphere
-    Scene3D *sphere = Scene3D_create();
-    object = Object3D_create_sphere((Coordinate3D){0, 0, 0}, 20, 90);
-    Scene3D_append(sphere, object);
-
-    serialize(sphere, "sphere");
-    Scene3D_destroy(sphere);
-
-    // spheres
-    Scene3D *spheres = Scene3D_create();
-    double inc[] = {15, 10, 5, 36, 30, 20, 90, 60, 45};
-    for(int i = 0; i < 3; i += 1) {
-        for(int j = 0; j < 3; ++j) {
-            object = Object3D_create_sphere((Coordinate3D){j*100, i*100, 0}, 45, inc[(i*3)+j]);
-            Scene3D_append(spheres, object);
-            printf("count: %ld\n", object->count);
-        }
-    }
-    serialize(spheres, "spheres");
-    Scene3D_destroy(spheres);
-
-
-    // fractals
-    Scene3D* fractals = Scene3D_create();
-    const int highest_level = 6;
-
-    for(int level = 0; level <= highest_level; ++level) {
-        int i = level / 3;
-        int j = level % 3;
-        Coordinate3D origin = (Coordinate3D){j*100, i*100, 0};
-        object = Object3D_create_fractal(origin, 50, level);
-        Scene3D_append(fractals, object);
-        printf("Count for level %d: %ld\n", level, object->count);
-    }
-    
-    serialize(fractals, "fractals");
-    Scene3D_destroy(fractals);
-    printf("All written!\n");
+/**
+ * @brief Parses one primitive line into p.
+ *
+ * @return int 0 on success, -1 if the line is malformed
+ */
+int parse_primitive(const char* keyword, const char* rest, Primitive3D* p) {
+    Coordinate3D* o = &p->origin;
+    char extra[2];
+    if(!strcmp(keyword, "cuboid")) {
+        p->kind = PRIMITIVE3D_CUBOID;
+        return sscanf(rest, "%lf %lf %lf %lf %lf %lf %1s", &o->x, &o->y, &o->z,
+            &p->cuboid.width, &p->cuboid.height, &p->cuboid.depth, extra) == 6? 0: -1;
+    } else if(!strcmp(keyword, "pyramid")) {
+        char orientation[16];
+        p->kind = PRIMITIVE3D_PYRAMID;
+        return sscanf(rest, "%lf %lf %lf %lf %lf %15s %1s", &o->x, &o->y, &o->z,
+            &p->pyramid.width, &p->pyramid.height, orientation, extra) == 6
+            && Orientation3D_parse(orientation, &p->pyramid.orientation) == 0? 0: -1;
+    } else if(!strcmp(keyword, "sphere")) {
+        p->kind = PRIMITIVE3D_SPHERE;
+        return sscanf(rest, "%lf %lf %lf %lf %lf %1s", &o->x, &o->y, &o->z,
+            &p->sphere.radius, &p->sphere.increment, extra) == 5
+            && Primitive3D_triangles(p) >= 0? 0: -1;
+    } else if(!strcmp(keyword, "sphere_lod")) {
+        p->kind = PRIMITIVE3D_SPHERE_LOD;
+        return sscanf(rest, "%lf %lf %lf %lf %lf %1s", &o->x, &o->y, &o->z,
+            &p->sphere_lod.radius, &p->sphere_lod.tolerance, extra) == 5
+            && Primitive3D_triangles(p) >= 0? 0: -1;
+    } else if(!strcmp(keyword, "fractal")) {
+        p->kind = PRIMITIVE3D_FRACTAL;
+        return sscanf(rest, "%lf %lf %lf %lf %d %1s", &o->x, &o->y, &o->z,
+            &p->fractal.size, &p->fractal.levels, extra) == 5
+            && Primitive3D_triangles(p) >= 0? 0: -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Parses the output formats listed in rest into job->outputs.
+ *
+ * @return int 0 on success, -1 on an unknown format
+ */
+int parse_outputs(char* rest, SceneJob* job) {
+    for(char* token = strtok(rest, " \t"); token != NULL; token = strtok(NULL, " \t")) {
+        size_t len = strlen(token);
+        int gzip = len > 3 && !strcmp(token + len - 3, ".gz");
+        if(gzip) {
+            token[len - 3] = '\0';
+        }
+        int f = 0;
+        while(f < FORMAT_COUNT && strcmp(token, FORMAT_NAMES[f]) != 0) {
+            ++f;
+        }
+        if(f == FORMAT_COUNT) {
+            return -1;
+        }
+        job->outputs |= 1u << f;
+        if(gzip) {
+            job->outputs |= 1u << (FORMAT_COUNT + f);
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Reads every scene of a description file into batch->jobs.
+ *
+ * @return int 0 on success, -1 if the file could not be read or parsed
+ */
+int Batch_parse(Batch* batch, const char* file_name) {
+    FILE* f = !strcmp(file_name, "-")? stdin: fopen(file_name, "r");
+    if(f == NULL) {
+        perror(file_name);
+        return -1;
+    }
+    char line[LINE_MAX_LEN];
+    int line_no = 0;
+    SceneJob* job = NULL;
+    int status = 0;
+    while(status == 0 && fgets(line, sizeof(line), f) != NULL) {
+        ++line_no;
+        char* comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+        char keyword[32];
+        int consumed = 0;
+        if(sscanf(line, "%31s %n", keyword, &consumed) != 1) {
+            continue; // blank line
+        }
+        char* rest = line + consumed;
+        rest[strcspn(rest, "\r\n")] = '\0';
+        if(!strcmp(keyword, "scene")) {
+            if(job != NULL) {
+                status = parse_error(file_name, line_no, "scene inside a scene, missing end");
+                break;
+            }
+            if(batch->count == batch->size) {
+                batch->jobs = grow(batch->jobs, &batch->size, sizeof(SceneJob));
+            }
+            job = &batch->jobs[batch->count++];
+            memset(job, 0, sizeof(SceneJob));
+            job->dedup = -1.0;
+            char extra[2];
+            if(sscanf(rest, "%255s %1s", job->name, extra) != 1) {
+                status = parse_error(file_name, line_no, "expected: scene <name>");
+            }
+        } else if(job == NULL) {
+            status = parse_error(file_name, line_no, "expected: scene <name>");
+        } else if(!strcmp(keyword, "end")) {
+            if(job->outputs == 0) {
+                status = parse_error(file_name, line_no, "scene has no output");
+            }
+            job = NULL;
+        } else if(!strcmp(keyword, "dedup")) {
+            char extra[2];
+            if(sscanf(rest, "%lf %1s", &job->dedup, extra) != 1 || !(job->dedup >= 0.0)) {
+                status = parse_error(file_name, line_no, "expected: dedup <tolerance>");
+            }
+        } else if(!strcmp(keyword, "output")) {
+            if(parse_outputs(rest, job) != 0) {
+                status = parse_error(file_name, line_no, "unknown output format");
+            }
+        } else {
+            if(job->count == job->size) {
+                job->primitives = grow(job->primitives, &job->size, sizeof(Primitive3D));
+            }
+            if(parse_primitive(keyword, rest, &job->primitives[job->count]) != 0) {
+                status = parse_error(file_name, line_no, "malformed primitive");
+            }
+            ++job->count;
+        }
+    }
+    if(status == 0 && job != NULL) {
+        status = parse_error(file_name, line_no, "missing end");
+    }
+    if(f != stdin) {
+        fclose(f);
+    }
+    return status;
+}
+
+Object3D* Primitive_create(const Primitive3D* p, PrimitiveCache3D* cache) {
+    switch(p->kind) {
+        case PRIMITIVE3D_SPHERE:
+            return PrimitiveCache3D_create_sphere(cache, p->origin, p->sphere.radius, p->sphere.increment);
+        case PRIMITIVE3D_FRACTAL:
+            return PrimitiveCache3D_create_fractal(cache, p->origin, p->fractal.size, p->fractal.levels);
+        default:
+            return Primitive3D_create(p);
+    }
+}
+
+/**
+ * @brief Builds one scene and writes all of its outputs.
+ *
+ * @return int 0 on success, -1 if anything failed
+ */
+int SceneJob_run(const SceneJob* job, const char* output_dir, PrimitiveCache3D* cache,
+    int gzip_threads)
+{
+    Scene3D* scene = Scene3D_create();
+    if(scene == NULL) {
+        fprintf(stderr, "%s: failed to create the scene\n", job->name);
+        return -1;
+    }
+    // without a cache the whole scene is built in one batch (on this
+    // thread: the other workers are busy with scenes of their own)
+    if(cache == NULL && Scene3D_append_primitives(scene, job->primitives, job->count, 1) != 0) {
+        fprintf(stderr, "%s: failed to create the primitives\n", job->name);
+        Scene3D_destroy(scene);
+        return -1;
+    }
+    for(long i = 0; cache != NULL && i < job->count; ++i) {
+        Object3D* object = Primitive_create(&job->primitives[i], cache);
+        if(object == NULL) {
+            fprintf(stderr, "%s: failed to create primitive %ld\n", job->name, i);
+            Scene3D_destroy(scene);
+            return -1;
+        }
+        if(Scene3D_append(scene, object) != 0) {
+            fprintf(stderr, "%s: failed to append primitive %ld\n", job->name, i);
+            Object3D_dtor(object);
+            Scene3D_destroy(scene);
+            return -1;
+        }
+    }
+    if(job->dedup >= 0.0 && Scene3D_dedup_triangles(scene, job->dedup, 1) < 0) {
+        fprintf(stderr, "%s: failed to remove duplicate triangles\n", job->name);
+        Scene3D_destroy(scene);
+        return -1;
+    }
+    int status = 0;
+    char path[2 * NAME_MAX_LEN + 32];
+    for(int f = 0; f < FORMAT_COUNT; ++f) {
+        if(!(job->outputs & (1u << f))) {
+            continue;
+        }
+        int gzip = (job->outputs & (1u << (FORMAT_COUNT + f))) != 0;
+        snprintf(path, sizeof(path), "%s%s%s%s%s", output_dir, *output_dir? "/": "",
+            job->name, FORMAT_EXTENSIONS[f], gzip? ".gz": "");
+        const char* mode = (f == FORMAT_STL_TEXT || f == FORMAT_OBJ)? "w": "wb";
+        OutputSink3D* sink = gzip? OutputSink3D_open_gzip(path, 6, gzip_threads): OutputSink3D_open_file(path, mode);
+        int written = -1;
+        switch(f) {
+            case FORMAT_STL_TEXT: written = Scene3D_swrite_stl_text(scene, sink); break;
+            case FORMAT_STL_BINARY: written = Scene3D_swrite_stl_binary(scene, sink); break;
+            case FORMAT_PLY_BINARY: written = Scene3D_swrite_ply_binary(scene, sink); break;
+            case FORMAT_OBJ: written = Scene3D_swrite_obj(scene, sink); break;
+        }
+        if(written == 0) {
+            printf("Wrote to %s\n", path);
+        } else {
+            fprintf(stderr, "Failed to write %s\n", path);
+            status = -1;
+        }
+    }
+    Scene3D_destroy(scene);
+    return status;
+}
+
+int Batch_worker(void* arg) {
+    Batch* batch = arg;
+    MemoryBudget3D* previous = MemoryBudget3D_bind(batch->memory);
+    mtx_lock(&batch->lock);
+    while(batch->next_job < batch->count) {
+        long j = batch->next_job++;
+        SceneJob* job = &batch->jobs[j];
+        while(batch->next_admit != j
+        || (batch->jobs_in_flight > 0 && batch->in_flight + job->estimate > batch->budget)) {
+            cnd_wait(&batch->released, &batch->lock);
+        }
+        ++batch->next_admit;
+        batch->in_flight += job->estimate;
+        ++batch->jobs_in_flight;
+        cnd_broadcast(&batch->released); // the next job may be admitted too
+        mtx_unlock(&batch->lock);
+
+        int status = SceneJob_run(job, batch->output_dir, batch->cache, batch->gzip_threads);
+
+        mtx_lock(&batch->lock);
+        batch->in_flight -= job->estimate;
+        --batch->jobs_in_flight;
+        batch->failures += status != 0;
+        cnd_broadcast(&batch->released);
+    }
+    mtx_unlock(&batch->lock);
+    MemoryBudget3D_bind(previous);
+    return 0;
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr,
+        "usage: %s [-j threads] [-m budget_mb] [-o output_dir] [-c cache_file] [-C cache_mb]\n"
+        "       file.scene ...\n"
+        "  -j  scenes built concurrently (default: one per CPU)\n"
+        "  -m  memory all in-flight scenes may use, in MiB (at least 1); scenes\n"
+        "      are admitted by estimate and fail if they actually go over it\n"
+        "      (default: half of the physical memory)\n"
+        "  -o  directory to write the outputs to (default: .)\n"
+        "  -c  reuse the spheres and fractals stored in cache_file and store\n"
+        "      this run's ones in it afterwards\n"
+        "  -C  keep up to cache_mb MiB of generated spheres and fractals to\n"
+        "      copy instead of regenerating (default: 256 with -c, else off)\n"
+        "  A file name of - reads the scene description from stdin.\n", argv0);
+}
+
+/**
+ * @brief Parses a size in MiB from a command line option.
+ *
+ * @return long the size, or -1 if arg is not a whole number in
+ * [low, the MiB that fit in a size_t)
+ */
+long parse_mb(const char* arg, long low) {
+    char* end;
+    errno = 0;
+    long mb = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || mb < low || (unsigned long)mb > (SIZE_MAX >> 20)) {
+        return -1;
+    }
+    return mb;
+}
+
+int main(int argc, char** argv) {
+    int threads = System3D_cpu_count();
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    size_t budget = pages > 0 && page_size > 0? (size_t)pages * page_size / 2: (size_t)1 << 30;
+    const char* output_dir = "";
+    const char* cache_file = NULL;
+    long cache_mb = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "j:m:o:c:C:")) != -1) {
+        switch(opt) {
+            case 'j': threads = atoi(optarg); break;
+            case 'm':
+                // a budget of 0 would mean no budget at all
+                if(parse_mb(optarg, 1) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                budget = (size_t)parse_mb(optarg, 1) << 20;
+                break;
+            case 'o': output_dir = optarg; break;
+            case 'c': cache_file = optarg; break;
+            case 'C':
+                cache_mb = parse_mb(optarg, 0);
+                if(cache_mb < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind == argc || threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.output_dir = output_dir;
+    batch.budget = budget;
+    batch.memory = MemoryBudget3D_create(budget);
+    int status = batch.memory != NULL? 0: -1;
+    if(status != 0) {
+        fprintf(stderr, "Failed to set up a memory budget of %zu bytes\n", budget);
+    }
+    for(int i = optind; status == 0 && i < argc; ++i) {
+        status = Batch_parse(&batch, argv[i]);
+    }
+    if(cache_mb < 0 && cache_file != NULL) {
+        cache_mb = DEFAULT_CACHE_MB;
+    }
+    if(status == 0 && cache_mb > 0) {
+        batch.cache = PrimitiveCache3D_create((size_t)cache_mb << 20);
+        if(batch.cache == NULL) {
+            fprintf(stderr, "Failed to create the primitive cache, generating everything\n");
+        }
+        // a missing cache file is just a cold start
+        if(batch.cache != NULL && cache_file != NULL && access(cache_file, F_OK) == 0
+        && PrimitiveCache3D_load(batch.cache, cache_file) != 0) {
+            fprintf(stderr, "%s: not a usable cache file, ignoring the rest of it\n", cache_file);
+        }
+    }
+    if(status == 0) {
+        mtx_init(&batch.lock, mtx_plain);
+        cnd_init(&batch.released);
+        if(threads > batch.count) {
+            threads = batch.count > 0? batch.count: 1;
+        }
+        batch.gzip_threads = System3D_cpu_count() / threads;
+        batch.gzip_threads = batch.gzip_threads > 0? batch.gzip_threads: 1;
+        for(long i = 0; i < batch.count; ++i) {
+            batch.jobs[i].estimate = SceneJob_estimate(&batch.jobs[i], batch.gzip_threads);
+        }
+        thrd_t* pool = malloc(sizeof(thrd_t) * threads);
+        int started = 0;
+        for(; pool != NULL && started < threads; ++started) {
+            if(thrd_create(&pool[started], Batch_worker, &batch) != thrd_success) {
+                break;
+            }
+        }
+        if(started == 0) {
+            Batch_worker(&batch); // no threads, run everything here
+        }
+        for(int i = 0; i < started; ++i) {
+            thrd_join(pool[i], NULL);
+        }
+        free(pool);
+        cnd_destroy(&batch.released);
+        mtx_destroy(&batch.lock);
+        if(batch.failures > 0) {
+            fprintf(stderr, "%d of %ld scenes failed\n", batch.failures, batch.count);
+            status = -1;
+        } else {
+            printf("All written!\n");
+        }
+        if(batch.cache != NULL && cache_file != NULL
+        && PrimitiveCache3D_save(batch.cache, cache_file) != 0) {
+            fprintf(stderr, "Failed to write %s\n", cache_file);
+        }
+    }
+    PrimitiveCache3D_destroy(batch.cache);
+    if(batch.memory != NULL) {
+        MemoryBudget3D_destroy(batch.memory);
+    }
+    for(long i = 0; i < batch.count; ++i) {
+        free(batch.jobs[i].primitives);
+    }
+    free(batch.jobs);
+    return status == 0? 0: 1;
+}
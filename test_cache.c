@@ -0,0 +1,81 @@
+/**
+ * @file test_cache.c
+ * @author Pegasust
+ * @brief Checks of the primitive cache that need its internals, so it
+ * builds the library itself from 3d.c instead of linking 3d.o
+ * @version 0.1
+ * @date 2022-04-19
+ *
+ */
+#include "3d.c"
+
+int failures;
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while(0)
+
+void set_refs(PrimitiveCache3D* cache, int refs) {
+    mtx_lock(&cache->lock);
+    for(PrimitiveEntry* entry = cache->head; entry != NULL; entry = entry->next) {
+        entry->refs = refs;
+    }
+    mtx_unlock(&cache->lock);
+}
+
+/**
+ * @brief With every entry pinned by a copy in progress, a new shape is
+ * served uncached and the cache stays within max_bytes; once unpinned,
+ * the shape evicts its way in.
+ */
+void test_pinned_entries() {
+    Coordinate3D origin = {10.0, 0.0, 0.0};
+    // spheres of one increment have the same triangle count, so two fit
+    Object3D* sphere = Object3D_create_sphere(origin, 1.0, 30.0);
+    CHECK(sphere != NULL);
+    if(sphere == NULL) {
+        return;
+    }
+    long count = sphere->count;
+    Object3D_dtor(sphere);
+    PrimitiveCache3D* cache = PrimitiveCache3D_create(2 * PrimitiveEntry_bytes(count));
+    CHECK(cache != NULL);
+    if(cache == NULL) {
+        return;
+    }
+    Object3D_dtor(PrimitiveCache3D_create_sphere(cache, origin, 1.0, 30.0));
+    Object3D_dtor(PrimitiveCache3D_create_sphere(cache, origin, 2.0, 30.0));
+    PrimitiveCache3DStats stats;
+    PrimitiveCache3D_stats(cache, &stats);
+    CHECK(stats.entries == 2);
+
+    set_refs(cache, 1);
+    Object3D* uncached = PrimitiveCache3D_create_sphere(cache, origin, 3.0, 30.0);
+    CHECK(uncached != NULL && uncached->count == count);
+    Object3D_dtor(uncached);
+    PrimitiveCache3D_stats(cache, &stats);
+    CHECK(stats.entries == 2);
+    CHECK(stats.evictions == 0);
+    CHECK(stats.bytes <= 2 * PrimitiveEntry_bytes(count));
+
+    set_refs(cache, 0);
+    Object3D_dtor(PrimitiveCache3D_create_sphere(cache, origin, 3.0, 30.0));
+    PrimitiveCache3D_stats(cache, &stats);
+    CHECK(stats.entries == 2);
+    CHECK(stats.evictions == 1);
+    CHECK(stats.bytes <= 2 * PrimitiveEntry_bytes(count));
+    PrimitiveCache3D_destroy(cache);
+}
+
+int main() {
+    test_pinned_entries();
+    if(failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All cache checks passed\n");
+    return 0;
+}